@@ -0,0 +1,40 @@
+#pragma once
+
+// No kernel dependencies: the caller gathers the facts from the file system,
+// so the decision can be exercised against a simulated one.
+
+enum class BackupMethod {
+	None,		// nothing to keep (a directory)
+	Link,		// hard link into the vault, then let the delete go through
+	Store,		// chunks into the volume's deduplicated store, and keep the file
+	Copy,		// copy the contents and keep the file
+};
+
+// what ChooseBackupMethod looks at
+struct BackupCandidate {
+	bool SameVolume;			// the file and the vault are on the same volume
+	bool VolumeSupportsLinks;	// FILE_SUPPORTS_HARD_LINKS
+	bool Directory;
+	unsigned LinkCount;			// names the file has now
+	bool LinkFailed;			// a link was already tried and failed
+	bool StoreReady;			// the vault's volume has a chunk store
+	bool PreferStore;			// store even where a link could be made
+};
+
+// NTFS allows this many names per file
+const unsigned MaxFileLinks = 1024;
+
+// A link costs the same whatever the file size, so it is preferred whenever
+// the file system can make one, unless asked to store everything (a link
+// keeps the file's clusters, the store only the chunks it doesn't have yet).
+// Otherwise the chunk store, and a plain copy if there is none.
+inline BackupMethod ChooseBackupMethod(const BackupCandidate& file) {
+	if (file.Directory)
+		return BackupMethod::None;
+	auto canLink = file.SameVolume && file.VolumeSupportsLinks && !file.LinkFailed && file.LinkCount < MaxFileLinks;
+	if (canLink && !(file.PreferStore && file.StoreReady))
+		return BackupMethod::Link;
+	if (file.SameVolume && file.StoreReady)
+		return BackupMethod::Store;
+	return BackupMethod::Copy;
+}
@@ -0,0 +1,217 @@
+#include "BackupQueue.h"
+#include "DelProtectCommon.h"
+
+NTSTATUS BackupQueue::Init(PFLT_FILTER filter, ULONG workers, ULONG queueLimit, BackupCopyRoutine copy, ULONG tag) {
+	m_Filter = filter;
+	InitializeListHead(&m_Queue);
+	KeInitializeSpinLock(&m_Lock);
+	KeInitializeSemaphore(&m_Ready, 0, MAXLONG);
+	m_WorkerCount = 0;
+	m_QueueLimit = queueLimit;
+	m_Depth = m_MaxDepth = 0;
+	m_Stopping = false;
+	m_Copy = copy;
+	m_Tag = tag;
+	m_Queued = m_Synchronous = m_Completed = m_Failed = 0;
+	m_TotalWaitTime = m_TotalCopyTime = m_MaxCopyTime = 0;
+	RtlZeroMemory(&m_Counters, sizeof(m_Counters));
+
+	if (workers > MaxWorkers)
+		workers = MaxWorkers;
+
+	for (ULONG i = 0; i < workers; i++) {
+		HANDLE hThread;
+		auto status = PsCreateSystemThread(&hThread, THREAD_ALL_ACCESS, nullptr, nullptr, nullptr, WorkerThread, this);
+		if (!NT_SUCCESS(status)) {
+			Shutdown();
+			return status;
+		}
+
+		status = ObReferenceObjectByHandle(hThread, SYNCHRONIZE, *PsThreadType, KernelMode, (PVOID*)&m_Workers[i], nullptr);
+		ZwClose(hThread);
+		if (!NT_SUCCESS(status)) {
+			// the thread still gets its stop signal, it just can't be waited for
+			m_Workers[i] = nullptr;
+			m_WorkerCount++;
+			Shutdown();
+			return status;
+		}
+		m_WorkerCount++;
+	}
+	return STATUS_SUCCESS;
+}
+
+void BackupQueue::Shutdown() {
+	KIRQL irql;
+	KeAcquireSpinLock(&m_Lock, &irql);
+	m_Stopping = true;
+	KeReleaseSpinLock(&m_Lock, irql);
+
+	// every worker drains the queue before it sees the stop signal
+	if (m_WorkerCount > 0)
+		KeReleaseSemaphore(&m_Ready, IO_NO_INCREMENT, m_WorkerCount, FALSE);
+	for (ULONG i = 0; i < m_WorkerCount; i++) {
+		if (m_Workers[i]) {
+			KeWaitForSingleObject(m_Workers[i], Executive, KernelMode, FALSE, nullptr);
+			ObDereferenceObject(m_Workers[i]);
+			m_Workers[i] = nullptr;
+		}
+	}
+	m_WorkerCount = 0;
+}
+
+NTSTATUS BackupQueue::Backup(const InstanceFile& source, const InstanceFile& target, ULONG flags) {
+	auto item = (BackupItem*)ExAllocatePoolWithTag(PagedPool,
+		sizeof(BackupItem) + source.Name.Length + target.Name.Length, m_Tag);
+	// the instances must stay attached until the worker is done with them
+	if (item && !NT_SUCCESS(FltObjectReference(source.Instance))) {
+		ExFreePoolWithTag(item, m_Tag);
+		item = nullptr;
+	}
+	if (item && !NT_SUCCESS(FltObjectReference(target.Instance))) {
+		FltObjectDereference(source.Instance);
+		ExFreePoolWithTag(item, m_Tag);
+		item = nullptr;
+	}
+	if (item) {
+		item->Source.Instance = source.Instance;
+		item->Source.File = nullptr;
+		item->SourceHandle = nullptr;
+		item->Source.Name.Buffer = item->Names;
+		item->Source.Name.Length = item->Source.Name.MaximumLength = source.Name.Length;
+		RtlCopyMemory(item->Source.Name.Buffer, source.Name.Buffer, source.Name.Length);
+		item->Target.Instance = target.Instance;
+		item->Target.File = nullptr;
+		item->Target.Name.Buffer = item->Names + source.Name.Length / sizeof(WCHAR);
+		item->Target.Name.Length = item->Target.Name.MaximumLength = target.Name.Length;
+		RtlCopyMemory(item->Target.Name.Buffer, target.Name.Buffer, target.Name.Length);
+		item->Flags = flags;
+		item->QueueTime = KeQueryInterruptTime();
+
+		auto queued = false;
+		if (NT_SUCCESS(OpenSource(item))) {
+			KIRQL irql;
+			KeAcquireSpinLock(&m_Lock, &irql);
+			if (!m_Stopping && m_WorkerCount > 0 && m_Depth < m_QueueLimit) {
+				InsertTailList(&m_Queue, &item->Entry);
+				if (++m_Depth > m_MaxDepth)
+					m_MaxDepth = m_Depth;
+				queued = true;
+			}
+			KeReleaseSpinLock(&m_Lock, irql);
+		}
+
+		if (queued) {
+			InterlockedIncrement(&m_Queued);
+			KeReleaseSemaphore(&m_Ready, IO_NO_INCREMENT, 1, FALSE);
+			return STATUS_PENDING;
+		}
+		FreeItem(item);
+	}
+
+	// queue full (or no memory for the item, or the source can't be held open): copy right here
+	InterlockedIncrement(&m_Synchronous);
+	return Copy(source, target, flags);
+}
+
+void BackupQueue::GetStats(BackupStats* stats) {
+	KIRQL irql;
+	KeAcquireSpinLock(&m_Lock, &irql);
+	stats->Depth = m_Depth;
+	stats->MaxDepth = m_MaxDepth;
+	KeReleaseSpinLock(&m_Lock, irql);
+
+	stats->Queued = m_Queued;
+	stats->Synchronous = m_Synchronous;
+	stats->Completed = m_Completed;
+	stats->Failed = m_Failed;
+	stats->QueueLimit = m_QueueLimit;
+	stats->Workers = m_WorkerCount;
+	stats->TotalWaitTime = m_TotalWaitTime;
+	stats->TotalCopyTime = m_TotalCopyTime;
+	stats->MaxCopyTime = m_MaxCopyTime;
+	stats->BytesCopied = m_Counters.BytesWritten;
+	stats->BytesRead = m_Counters.BytesRead;
+	stats->ReadIos = m_Counters.Reads;
+	stats->WriteIos = m_Counters.Writes;
+}
+
+void BackupQueue::WorkerThread(PVOID context) {
+	((BackupQueue*)context)->Run();
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+void BackupQueue::Run() {
+	for (;;) {
+		KeWaitForSingleObject(&m_Ready, Executive, KernelMode, FALSE, nullptr);
+
+		BackupItem* item = nullptr;
+		KIRQL irql;
+		KeAcquireSpinLock(&m_Lock, &irql);
+		if (!IsListEmpty(&m_Queue)) {
+			item = CONTAINING_RECORD(RemoveHeadList(&m_Queue), BackupItem, Entry);
+			m_Depth--;
+		}
+		auto stopping = m_Stopping;
+		KeReleaseSpinLock(&m_Lock, irql);
+
+		if (!item) {
+			// the only counts without an item are the stop signals
+			NT_ASSERT(stopping);
+			break;
+		}
+
+		InterlockedAdd64(&m_TotalWaitTime, KeQueryInterruptTime() - item->QueueTime);
+		auto status = Copy(item->Source, item->Target, item->Flags);
+		if (!NT_SUCCESS(status))
+			KdPrint(("DelProtect: backup of %wZ failed (0x%08X)\n", &item->Source.Name, status));
+		FreeItem(item);
+	}
+}
+
+// Opens the source for the worker to read. Write sharing is denied so the
+// contents can't change before they are copied; delete sharing is allowed,
+// since the open keeps the file itself alive. No FILE_SYNCHRONOUS_IO_* flags,
+// as BlockReader keeps a read in flight.
+NTSTATUS BackupQueue::OpenSource(BackupItem* item) {
+	OBJECT_ATTRIBUTES attr;
+	IO_STATUS_BLOCK ioStatus;
+	InitializeObjectAttributes(&attr, &item->Source.Name, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+	auto status = FltCreateFileEx2(m_Filter, item->Source.Instance, &item->SourceHandle, &item->Source.File,
+		FILE_READ_DATA | FILE_READ_ATTRIBUTES | SYNCHRONIZE, &attr, &ioStatus, nullptr,
+		FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ | FILE_SHARE_DELETE, FILE_OPEN,
+		FILE_NON_DIRECTORY_FILE | FILE_SEQUENTIAL_ONLY, nullptr, 0, 0, nullptr);
+	if (!NT_SUCCESS(status)) {
+		item->SourceHandle = nullptr;
+		item->Source.File = nullptr;
+	}
+	return status;
+}
+
+void BackupQueue::FreeItem(BackupItem* item) {
+	if (item->Source.File)
+		ObDereferenceObject(item->Source.File);
+	if (item->SourceHandle)
+		FltClose(item->SourceHandle);
+	FltObjectDereference(item->Source.Instance);
+	FltObjectDereference(item->Target.Instance);
+	ExFreePoolWithTag(item, m_Tag);
+}
+
+NTSTATUS BackupQueue::Copy(const InstanceFile& source, const InstanceFile& target, ULONG flags) {
+	auto start = KeQueryInterruptTime();
+	auto status = m_Copy(source, target, flags, &m_Counters);
+	auto elapsed = (LONG64)(KeQueryInterruptTime() - start);
+
+	InterlockedIncrement(NT_SUCCESS(status) ? &m_Completed : &m_Failed);
+	InterlockedAdd64(&m_TotalCopyTime, elapsed);
+	UpdateMax(&m_MaxCopyTime, elapsed);
+	return status;
+}
+
+void BackupQueue::UpdateMax(LONG64 volatile* max, LONG64 value) {
+	for (auto current = *max; value > current; current = *max) {
+		if (InterlockedCompareExchange64(max, value, current) == current)
+			break;
+	}
+}
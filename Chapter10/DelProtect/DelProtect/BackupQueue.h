@@ -0,0 +1,70 @@
+#pragma once
+
+#include <fltKernel.h>
+#include "BlockReader.h"
+
+struct BackupStats;
+
+// copies source to target at PASSIVE_LEVEL, updating the counters as it goes;
+// flags are whatever was passed to BackupQueue::Backup
+typedef NTSTATUS (*BackupCopyRoutine)(const InstanceFile& source, const InstanceFile& target, ULONG flags, CopyCounters* counters);
+
+struct BackupItem {
+	LIST_ENTRY Entry;
+	ULONGLONG QueueTime;	// interrupt time
+	InstanceFile Source;	// the instances are referenced while queued
+	InstanceFile Target;
+	HANDLE SourceHandle;	// Source.File is read through this open
+	ULONG Flags;
+	WCHAR Names[1];			// both name buffers
+};
+
+// Runs backup copies on a small pool of system threads so the deleting
+// thread doesn't wait for the copy. The queue is bounded: once it is full,
+// Backup copies on the calling thread instead, which throttles whoever
+// deletes faster than the workers can copy.
+// A queued source is kept open until its copy is done, and the worker reads
+// through that open rather than the name: a delete, rename or replacement of
+// the name meanwhile doesn't reach the contents being backed up, and writes
+// are refused with a sharing violation. A source that can't be opened that
+// way (someone has it open for writing) is copied on the calling thread.
+// Backup at PASSIVE_LEVEL.
+class BackupQueue final {
+public:
+	static const ULONG MaxWorkers = 8;
+
+	NTSTATUS Init(PFLT_FILTER filter, ULONG workers, ULONG queueLimit, BackupCopyRoutine copy, ULONG tag);
+	// lets the workers finish what is queued, then stops them
+	void Shutdown();
+
+	// STATUS_PENDING if queued, otherwise the result of the inline copy
+	NTSTATUS Backup(const InstanceFile& source, const InstanceFile& target, ULONG flags);
+
+	void GetStats(BackupStats* stats);
+
+	static void UpdateMax(LONG64 volatile* max, LONG64 value);
+
+private:
+	static void WorkerThread(PVOID context);
+	void Run();
+	NTSTATUS Copy(const InstanceFile& source, const InstanceFile& target, ULONG flags);
+	NTSTATUS OpenSource(BackupItem* item);
+	void FreeItem(BackupItem* item);
+
+private:
+	PFLT_FILTER m_Filter;
+	LIST_ENTRY m_Queue;
+	KSPIN_LOCK m_Lock;
+	KSEMAPHORE m_Ready;		// one count per queued item, plus one per worker when stopping
+	PETHREAD m_Workers[MaxWorkers];
+	ULONG m_WorkerCount;
+	ULONG m_QueueLimit;
+	ULONG m_Depth, m_MaxDepth;	// guarded by m_Lock
+	bool m_Stopping;
+	BackupCopyRoutine m_Copy;
+	ULONG m_Tag;
+
+	LONG volatile m_Queued, m_Synchronous, m_Completed, m_Failed;
+	LONG64 volatile m_TotalWaitTime, m_TotalCopyTime, m_MaxCopyTime;
+	CopyCounters m_Counters;
+};
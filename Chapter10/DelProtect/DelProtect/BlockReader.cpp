@@ -0,0 +1,233 @@
+#include "BlockReader.h"
+
+namespace {
+	void OnReadDone(PFLT_CALLBACK_DATA data, PFLT_CONTEXT context) {
+		auto block = (ReadBlock*)context;
+		block->Status = data->IoStatus.Status;
+		block->Length = (ULONG)data->IoStatus.Information;
+		KeSetEvent(&block->Done, IO_NO_INCREMENT, FALSE);
+	}
+}
+
+ULONG NormalizeCopyBufferSize(ULONG size) {
+	if (size < MinCopyBufferSize)
+		return MinCopyBufferSize;
+	if (size > MaxCopyBufferSize)
+		return MaxCopyBufferSize;
+	return size & ~(MinCopyBufferSize - 1);
+}
+
+BlockReader::BlockReader() {
+	RtlZeroMemory(this, sizeof(*this));
+}
+
+BlockReader::~BlockReader() {
+	Close();
+}
+
+NTSTATUS BlockReader::Open(PFLT_FILTER filter, const InstanceFile& file, ULONG bufferSize, ULONG tag,
+	CopyCounters* counters) {
+	PAGED_CODE();
+
+	m_Instance = file.Instance;
+	m_Tag = tag;
+	m_Counters = counters;
+
+	if (file.File) {
+		// opened by the caller, also without FILE_SYNCHRONOUS_IO_*
+		ObReferenceObject(file.File);
+		m_FileObject = file.File;
+	}
+	else {
+		OBJECT_ATTRIBUTES attr;
+		IO_STATUS_BLOCK ioStatus;
+		// no FILE_SYNCHRONOUS_IO_* flags: the next read is in flight while the caller works
+		InitializeObjectAttributes(&attr, (PUNICODE_STRING)&file.Name, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+		auto status = FltCreateFileEx2(filter, file.Instance, &m_Handle, &m_FileObject,
+			FILE_READ_DATA | FILE_READ_ATTRIBUTES | SYNCHRONIZE, &attr, &ioStatus, nullptr,
+			FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_OPEN,
+			FILE_NON_DIRECTORY_FILE | FILE_SEQUENTIAL_ONLY, nullptr, 0, 0, nullptr);
+		if (!NT_SUCCESS(status)) {
+			m_Handle = nullptr;
+			m_FileObject = nullptr;
+			return status;
+		}
+	}
+
+	FILE_STANDARD_INFORMATION info;
+	auto status = FltQueryInformationFile(file.Instance, m_FileObject, &info, sizeof(info), FileStandardInformation, nullptr);
+	if (!NT_SUCCESS(status))
+		return status;
+	m_Size = info.EndOfFile.QuadPart;
+
+	// allocations of a page or more are page aligned, so also sector aligned
+	bufferSize = NormalizeCopyBufferSize(bufferSize);
+	for (;;) {
+		m_Blocks[0].Buffer = ExAllocatePoolWithTag(PagedPool, bufferSize, tag);
+		m_Blocks[1].Buffer = ExAllocatePoolWithTag(PagedPool, bufferSize, tag);
+		if ((m_Blocks[0].Buffer && m_Blocks[1].Buffer) || bufferSize == MinCopyBufferSize)
+			break;
+
+		// short on pool, try smaller blocks
+		for (auto& block : m_Blocks) {
+			if (block.Buffer) {
+				ExFreePoolWithTag(block.Buffer, tag);
+				block.Buffer = nullptr;
+			}
+		}
+		bufferSize /= 2;
+		if (bufferSize < MinCopyBufferSize)
+			bufferSize = MinCopyBufferSize;
+	}
+	if (!m_Blocks[0].Buffer || !m_Blocks[1].Buffer)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	m_BufferSize = bufferSize;
+	for (auto& block : m_Blocks)
+		KeInitializeEvent(&block.Done, NotificationEvent, FALSE);
+	return STATUS_SUCCESS;
+}
+
+void BlockReader::StartRead(ULONG block, LONGLONG offset) {
+	auto& b = m_Blocks[block];
+	LARGE_INTEGER byteOffset;
+	byteOffset.QuadPart = b.Offset = offset;
+	b.Status = STATUS_SUCCESS;
+	b.Length = 0;
+	if (offset >= m_Size) {
+		// nothing left to read
+		m_Pending[block] = STATUS_SUCCESS;
+		return;
+	}
+
+	// only the size seen at open is read, so the copy matches its preallocation
+	auto length = (ULONG)min((LONGLONG)m_BufferSize, m_Size - offset);
+	KeClearEvent(&b.Done);
+	if (m_Counters)
+		InterlockedIncrement64(&m_Counters->Reads);
+	// with a callback, the outcome of a read that was sent always arrives
+	// through it, even if the read completes inline; a failure here means
+	// the read was never sent
+	auto status = FltReadFile(m_Instance, m_FileObject, &byteOffset, length, b.Buffer,
+		FLTFL_IO_OPERATION_DO_NOT_UPDATE_BYTE_OFFSET, nullptr, OnReadDone, &b);
+	m_Pending[block] = NT_SUCCESS(status) ? STATUS_PENDING : status;
+}
+
+NTSTATUS BlockReader::WaitRead(ULONG block) {
+	auto& b = m_Blocks[block];
+	auto status = m_Pending[block];
+	if (status == STATUS_PENDING) {
+		KeWaitForSingleObject(&b.Done, Executive, KernelMode, FALSE, nullptr);
+		status = m_Pending[block] = b.Status;
+	}
+	return status;
+}
+
+NTSTATUS BlockReader::Next(PVOID& buffer, ULONG& length) {
+	buffer = nullptr;
+	length = 0;
+	if (m_End)
+		return STATUS_SUCCESS;
+
+	if (!m_Started) {
+		m_Started = true;
+		m_Current = 0;
+		StartRead(0, 0);
+	}
+	else {
+		// the caller is done with the current block, so the other one is next
+		m_Current ^= 1;
+	}
+
+	auto& block = m_Blocks[m_Current];
+	auto status = WaitRead(m_Current);
+	if (block.Offset >= m_Size) {
+		m_End = true;
+		return STATUS_SUCCESS;
+	}
+	if (!NT_SUCCESS(status))
+		return status;
+	// the file shrank while being read: fail rather than keep a truncated backup
+	if (block.Length == 0)
+		return STATUS_END_OF_FILE;
+
+	// read ahead into the buffer the caller just gave back
+	StartRead(m_Current ^ 1, block.Offset + block.Length);
+
+	if (m_Counters)
+		InterlockedAdd64(&m_Counters->BytesRead, block.Length);
+	buffer = block.Buffer;
+	length = block.Length;
+	return STATUS_SUCCESS;
+}
+
+void BlockReader::Close() {
+	// a read ahead may still be running into one of the buffers
+	for (ULONG i = 0; i < 2; i++) {
+		if (m_Pending[i] == STATUS_PENDING)
+			WaitRead(i);
+		if (m_Blocks[i].Buffer) {
+			ExFreePoolWithTag(m_Blocks[i].Buffer, m_Tag);
+			m_Blocks[i].Buffer = nullptr;
+		}
+	}
+	if (m_FileObject) {
+		ObDereferenceObject(m_FileObject);
+		m_FileObject = nullptr;
+	}
+	if (m_Handle) {
+		FltClose(m_Handle);
+		m_Handle = nullptr;
+	}
+}
+
+NTSTATUS CopyFileContents(PFLT_FILTER filter, const InstanceFile& source, const InstanceFile& target,
+	ULONG bufferSize, ULONG tag, CopyCounters* counters, LONGLONG* bytesCopied) {
+	PAGED_CODE();
+
+	BlockReader reader;
+	auto status = reader.Open(filter, source, bufferSize, tag, counters);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	// overwrite rather than open: a shorter copy must not keep an older copy's tail
+	OBJECT_ATTRIBUTES attr;
+	IO_STATUS_BLOCK ioStatus;
+	LARGE_INTEGER allocationSize;
+	allocationSize.QuadPart = reader.Size();
+	InitializeObjectAttributes(&attr, (PUNICODE_STRING)&target.Name, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+	HANDLE hTarget;
+	PFILE_OBJECT targetObject;
+	status = FltCreateFileEx2(filter, target.Instance, &hTarget, &targetObject,
+		FILE_WRITE_DATA | SYNCHRONIZE, &attr, &ioStatus, &allocationSize,
+		FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OVERWRITE_IF,
+		FILE_NON_DIRECTORY_FILE | FILE_SEQUENTIAL_ONLY | FILE_SYNCHRONOUS_IO_NONALERT, nullptr, 0, 0, nullptr);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	// each write overlaps the read of the next block
+	LARGE_INTEGER offset{};
+	for (;;) {
+		PVOID buffer;
+		ULONG length;
+		status = reader.Next(buffer, length);
+		if (!NT_SUCCESS(status) || length == 0)
+			break;
+
+		if (counters)
+			InterlockedIncrement64(&counters->Writes);
+		ULONG written;
+		status = FltWriteFile(target.Instance, targetObject, &offset, length, buffer, 0, &written, nullptr, nullptr);
+		if (!NT_SUCCESS(status))
+			break;
+		if (counters)
+			InterlockedAdd64(&counters->BytesWritten, length);
+		offset.QuadPart += length;
+	}
+
+	if (bytesCopied)
+		*bytesCopied = offset.QuadPart;
+	ObDereferenceObject(targetObject);
+	FltClose(hTarget);
+	return status;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <fltKernel.h>
+
+// read buffer sizes, in bytes; sizes are rounded down to a multiple of the minimum
+const ULONG MinCopyBufferSize = 64 * 1024;
+const ULONG MaxCopyBufferSize = 8 * 1024 * 1024;
+const ULONG DefaultCopyBufferSize = 1024 * 1024;
+
+// a file and the filter instance on the volume that holds it; if File is
+// set, the file is read through it instead of being opened by name
+struct InstanceFile {
+	PFLT_INSTANCE Instance;
+	UNICODE_STRING Name;
+	PFILE_OBJECT File;
+};
+
+// updated as backups progress; shared by all backups that are given it
+struct CopyCounters {
+	LONG64 volatile Reads;			// reads sent below the instance
+	LONG64 volatile Writes;			// writes sent below the instance
+	LONG64 volatile BytesRead;
+	LONG64 volatile BytesWritten;
+};
+
+// A block being read, or handed to the caller.
+struct ReadBlock {
+	PVOID Buffer;
+	KEVENT Done;
+	NTSTATUS Status;
+	ULONG Length;		// bytes transferred by the last read
+	LONGLONG Offset;	// where the last read started
+};
+
+// Reads a file from start to end in large blocks, sending the reads below
+// the given instance so neither this filter nor the filters above it see
+// them. Two buffers are used: while the caller works on one block, the next
+// one is already being read into the other buffer. Smaller buffers are used
+// if the requested ones can't be allocated.
+// At PASSIVE_LEVEL.
+class BlockReader final {
+public:
+	BlockReader();
+	~BlockReader();
+
+	NTSTATUS Open(PFLT_FILTER filter, const InstanceFile& file, ULONG bufferSize, ULONG tag,
+		CopyCounters* counters = nullptr);
+
+	// the file size when it was opened
+	LONGLONG Size() const {
+		return m_Size;
+	}
+
+	// The next block, valid until the following call; length is zero once
+	// Size() bytes were returned. Fails if the file ends before that.
+	NTSTATUS Next(PVOID& buffer, ULONG& length);
+
+	void Close();
+
+private:
+	void StartRead(ULONG block, LONGLONG offset);
+	NTSTATUS WaitRead(ULONG block);
+
+private:
+	PFLT_INSTANCE m_Instance;
+	HANDLE m_Handle;
+	PFILE_OBJECT m_FileObject;
+	ReadBlock m_Blocks[2];
+	NTSTATUS m_Pending[2];		// STATUS_PENDING while the block's read is in flight
+	ULONG m_Current;			// the block the caller has
+	bool m_Started, m_End;
+	ULONG m_BufferSize;
+	ULONG m_Tag;
+	LONGLONG m_Size;
+	CopyCounters* m_Counters;
+};
+
+// Copies the contents of source to target, replacing target if it exists,
+// with all I/O sent below the given instances. The target is preallocated to
+// the source size up front. Counters, if given, are updated after every
+// block, so others can watch the progress; bytesCopied, if given, receives
+// this copy's total.
+// At PASSIVE_LEVEL.
+NTSTATUS CopyFileContents(PFLT_FILTER filter, const InstanceFile& source, const InstanceFile& target,
+	ULONG bufferSize, ULONG tag, CopyCounters* counters = nullptr, LONGLONG* bytesCopied = nullptr);
+
+ULONG NormalizeCopyBufferSize(ULONG size);
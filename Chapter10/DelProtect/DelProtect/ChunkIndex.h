@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string.h>
+
+// No kernel dependencies: the caller provides the memory and the locking.
+
+const unsigned ChunkDigestSize = 32;		// SHA-256
+
+struct ChunkDigest {
+	unsigned char Bytes[ChunkDigestSize];
+};
+
+// A fixed-size set of chunk digests, open-addressed in a table the caller
+// allocates. Digests are uniformly distributed already, so their first bytes
+// serve as the hash. The all-zero digest marks an empty slot (SHA-256 never
+// produces it in practice). Inserts stop once the table is three quarters
+// full; the index is then only a partial view of the store, which is fine for
+// callers that fall back to checking the store itself on a miss.
+class ChunkIndex final {
+public:
+	static size_t MemorySize(unsigned slots) {
+		return slots * sizeof(ChunkDigest);
+	}
+
+	// slots must be a power of two; memory is MemorySize(slots) bytes
+	void Init(void* memory, unsigned slots) {
+		m_Slots = (ChunkDigest*)memory;
+		m_SlotCount = slots;
+		m_Count = 0;
+		memset(m_Slots, 0, MemorySize(slots));
+	}
+
+	bool Contains(const ChunkDigest& digest) const {
+		for (auto i = Home(digest);; i = (i + 1) & (m_SlotCount - 1)) {
+			if (IsEmpty(m_Slots[i]))
+				return false;
+			if (memcmp(&m_Slots[i], &digest, sizeof(digest)) == 0)
+				return true;
+		}
+	}
+
+	// false if the table is full
+	bool Insert(const ChunkDigest& digest) {
+		if (m_Count >= m_SlotCount / 4 * 3)
+			return false;
+
+		for (auto i = Home(digest);; i = (i + 1) & (m_SlotCount - 1)) {
+			if (IsEmpty(m_Slots[i])) {
+				m_Slots[i] = digest;
+				m_Count++;
+				return true;
+			}
+			if (memcmp(&m_Slots[i], &digest, sizeof(digest)) == 0)
+				return true;
+		}
+	}
+
+	unsigned Count() const {
+		return m_Count;
+	}
+
+private:
+	unsigned Home(const ChunkDigest& digest) const {
+		unsigned hash;
+		memcpy(&hash, digest.Bytes, sizeof(hash));
+		return hash & (m_SlotCount - 1);
+	}
+
+	static bool IsEmpty(const ChunkDigest& digest) {
+		for (auto b : digest.Bytes) {
+			if (b)
+				return false;
+		}
+		return true;
+	}
+
+private:
+	ChunkDigest* m_Slots;
+	unsigned m_SlotCount;
+	unsigned m_Count;
+};
@@ -0,0 +1,364 @@
+#include "ChunkStore.h"
+#include "Chunker.h"
+#include "DelProtectCommon.h"
+
+namespace {
+	const WCHAR ChunkDirName[] = L"chunks\\";
+	// a chunk is written as <digest>.<sequence>.tmp, then renamed to <digest>
+	const USHORT TempSuffixLength = 1 + 8 + 4;
+	// entries written to a manifest at a time
+	const ULONG ManifestBatch = 256;
+
+	// a file created below the instance for synchronous writes
+	struct StoreFile {
+		HANDLE Handle;
+		PFILE_OBJECT FileObject;
+	};
+
+	NTSTATUS CreateStoreFile(PFLT_FILTER filter, PFLT_INSTANCE instance, PUNICODE_STRING name,
+		LONGLONG size, StoreFile& file) {
+		OBJECT_ATTRIBUTES attr;
+		IO_STATUS_BLOCK ioStatus;
+		LARGE_INTEGER allocationSize;
+		allocationSize.QuadPart = size;
+		InitializeObjectAttributes(&attr, name, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+		auto status = FltCreateFileEx2(filter, instance, &file.Handle, &file.FileObject,
+			FILE_WRITE_DATA | DELETE | SYNCHRONIZE, &attr, &ioStatus, size ? &allocationSize : nullptr,
+			FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_CREATE,
+			FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT, nullptr, 0, 0, nullptr);
+		if (!NT_SUCCESS(status)) {
+			file.Handle = nullptr;
+			file.FileObject = nullptr;
+		}
+		return status;
+	}
+
+	// a file that couldn't be written completely is deleted, so the store never holds partial files
+	void CloseStoreFile(PFLT_INSTANCE instance, StoreFile& file, bool keep) {
+		if (!file.FileObject)
+			return;
+
+		if (!keep) {
+			FILE_DISPOSITION_INFORMATION info;
+			info.DeleteFile = TRUE;
+			FltSetInformationFile(instance, file.FileObject, &info, sizeof(info), FileDispositionInformation);
+		}
+		ObDereferenceObject(file.FileObject);
+		FltClose(file.Handle);
+		file.FileObject = nullptr;
+		file.Handle = nullptr;
+	}
+
+	NTSTATUS WriteStoreFile(PFLT_INSTANCE instance, StoreFile& file, LONGLONG offset, PVOID data, ULONG size,
+		CopyCounters* counters, StoreResult* result) {
+		LARGE_INTEGER byteOffset;
+		byteOffset.QuadPart = offset;
+		if (counters)
+			InterlockedIncrement64(&counters->Writes);
+		ULONG written;
+		auto status = FltWriteFile(instance, file.FileObject, &byteOffset, size, data, 0, &written, nullptr, nullptr);
+		if (NT_SUCCESS(status)) {
+			if (counters)
+				InterlockedAdd64(&counters->BytesWritten, size);
+			if (result)
+				result->BytesWritten += size;
+		}
+		return status;
+	}
+
+	bool FileExists(PFLT_FILTER filter, PFLT_INSTANCE instance, PUNICODE_STRING name) {
+		OBJECT_ATTRIBUTES attr;
+		IO_STATUS_BLOCK ioStatus;
+		InitializeObjectAttributes(&attr, name, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+		HANDLE hFile;
+		auto status = FltCreateFileEx2(filter, instance, &hFile, nullptr, FILE_READ_ATTRIBUTES | SYNCHRONIZE,
+			&attr, &ioStatus, nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			FILE_OPEN, FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT, nullptr, 0, 0, nullptr);
+		if (!NT_SUCCESS(status))
+			return false;
+		FltClose(hFile);
+		return true;
+	}
+
+	void DigestToName(const ChunkDigest& digest, PWCH name) {
+		const WCHAR hex[] = L"0123456789abcdef";
+		for (auto b : digest.Bytes) {
+			*name++ = hex[b >> 4];
+			*name++ = hex[b & 15];
+		}
+	}
+}
+
+NTSTATUS ChunkStore::Init(PFLT_FILTER filter, PFLT_INSTANCE instance, PCUNICODE_STRING dir,
+	BCRYPT_ALG_HANDLE sha256, ULONG hashObjectSize, ULONG tag) {
+	PAGED_CODE();
+
+	m_Filter = filter;
+	m_Sha256 = sha256;
+	m_HashObjectSize = hashObjectSize;
+	m_Tag = tag;
+	m_IndexLock = 0;
+	m_TempSequence = 0;
+	m_IndexMemory = nullptr;
+	m_ChunkDir.Buffer = nullptr;
+
+	UNICODE_STRING chunkDirName = RTL_CONSTANT_STRING(ChunkDirName);
+	UNICODE_STRING chunkDir;
+	chunkDir.Length = 0;
+	chunkDir.MaximumLength = dir->Length + chunkDirName.Length;
+	chunkDir.Buffer = (PWCH)ExAllocatePoolWithTag(PagedPool, chunkDir.MaximumLength, tag);
+	if (!chunkDir.Buffer)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	RtlCopyUnicodeString(&chunkDir, dir);
+	RtlAppendUnicodeStringToString(&chunkDir, &chunkDirName);
+
+	// open the directory without its trailing backslash
+	UNICODE_STRING name = chunkDir;
+	name.Length -= sizeof(WCHAR);
+	OBJECT_ATTRIBUTES attr;
+	IO_STATUS_BLOCK ioStatus;
+	InitializeObjectAttributes(&attr, &name, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+	HANDLE hDir;
+	auto status = FltCreateFileEx2(filter, instance, &hDir, nullptr, FILE_LIST_DIRECTORY | SYNCHRONIZE,
+		&attr, &ioStatus, nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		FILE_OPEN_IF, FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT, nullptr, 0, 0, nullptr);
+	if (!NT_SUCCESS(status)) {
+		ExFreePoolWithTag(chunkDir.Buffer, tag);
+		return status;
+	}
+	FltClose(hDir);
+
+	// looked up under a spin lock, so non-paged; without it every chunk is checked on disk
+	m_IndexMemory = ExAllocatePoolWithTag(NonPagedPoolNx, ChunkIndex::MemorySize(IndexSlots), tag);
+	if (m_IndexMemory)
+		m_Index.Init(m_IndexMemory, IndexSlots);
+
+	m_ChunkDir = chunkDir;
+	return STATUS_SUCCESS;
+}
+
+void ChunkStore::Free() {
+	if (m_IndexMemory) {
+		ExFreePoolWithTag(m_IndexMemory, m_Tag);
+		m_IndexMemory = nullptr;
+	}
+	if (m_ChunkDir.Buffer) {
+		ExFreePoolWithTag(m_ChunkDir.Buffer, m_Tag);
+		m_ChunkDir.Buffer = nullptr;
+	}
+}
+
+bool ChunkStore::IsKnown(const ChunkDigest& digest) {
+	if (!m_IndexMemory)
+		return false;
+
+	auto irql = ExAcquireSpinLockShared(&m_IndexLock);
+	auto known = m_Index.Contains(digest);
+	ExReleaseSpinLockShared(&m_IndexLock, irql);
+	return known;
+}
+
+void ChunkStore::Remember(const ChunkDigest& digest) {
+	if (!m_IndexMemory)
+		return;
+
+	// once full, later chunks are only found on disk
+	auto irql = ExAcquireSpinLockExclusive(&m_IndexLock);
+	m_Index.Insert(digest);
+	ExReleaseSpinLockExclusive(&m_IndexLock, irql);
+}
+
+ULONG ChunkStore::IndexCount() {
+	if (!m_IndexMemory)
+		return 0;
+
+	auto irql = ExAcquireSpinLockShared(&m_IndexLock);
+	auto count = m_Index.Count();
+	ExReleaseSpinLockShared(&m_IndexLock, irql);
+	return count;
+}
+
+// Only complete chunks ever carry a digest name: a chunk is written and
+// flushed under a temporary name, then renamed without replacing. A crash
+// mid-write leaves only a temporary file, and two workers storing the same
+// new chunk both write it, the second finding the first one's on the rename.
+// name has room for the chunk directory, a digest and the temporary suffix;
+// stored is false if the chunk was there already.
+NTSTATUS ChunkStore::StoreChunk(PFLT_INSTANCE instance, const ChunkDigest& digest, PVOID data, ULONG size,
+	PUNICODE_STRING name, CopyCounters* counters, bool& stored) {
+	stored = false;
+	if (IsKnown(digest))
+		return STATUS_SUCCESS;
+
+	RtlCopyUnicodeString(name, &m_ChunkDir);
+	DigestToName(digest, name->Buffer + name->Length / sizeof(WCHAR));
+	name->Length += ChunkDigestSize * 2 * sizeof(WCHAR);
+	if (FileExists(m_Filter, instance, name)) {
+		// stored by an earlier backup the index doesn't know about
+		Remember(digest);
+		return STATUS_SUCCESS;
+	}
+
+	auto renameSize = FIELD_OFFSET(FILE_RENAME_INFORMATION, FileName) + name->Length;
+	auto rename = (FILE_RENAME_INFORMATION*)ExAllocatePoolWithTag(PagedPool, renameSize, m_Tag);
+	if (!rename)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	rename->ReplaceIfExists = FALSE;
+	rename->RootDirectory = nullptr;
+	rename->FileNameLength = name->Length;
+	RtlCopyMemory(rename->FileName, name->Buffer, name->Length);
+
+	const WCHAR hex[] = L"0123456789abcdef";
+	auto sequence = (ULONG)InterlockedIncrement(&m_TempSequence);
+	auto p = name->Buffer + name->Length / sizeof(WCHAR);
+	*p++ = L'.';
+	for (int i = 7; i >= 0; i--)
+		*p++ = hex[(sequence >> (i * 4)) & 15];
+	RtlCopyMemory(p, L".tmp", 4 * sizeof(WCHAR));
+	name->Length += TempSuffixLength * sizeof(WCHAR);
+
+	StoreFile file;
+	auto status = CreateStoreFile(m_Filter, instance, name, size, file);
+	if (NT_SUCCESS(status)) {
+		status = WriteStoreFile(instance, file, 0, data, size, counters, nullptr);
+		// the data must be on disk before the name says the chunk is there
+		if (NT_SUCCESS(status))
+			status = FltFlushBuffers(instance, file.FileObject);
+		if (NT_SUCCESS(status)) {
+			status = FltSetInformationFile(instance, file.FileObject, rename, renameSize, FileRenameInformation);
+			if (NT_SUCCESS(status))
+				stored = true;
+			else if (status == STATUS_OBJECT_NAME_COLLISION)
+				status = STATUS_SUCCESS;	// another worker stored it meanwhile
+		}
+		// the temporary file is deleted unless it became the chunk
+		CloseStoreFile(instance, file, stored);
+	}
+	ExFreePoolWithTag(rename, m_Tag);
+
+	if (NT_SUCCESS(status))
+		Remember(digest);
+	return status;
+}
+
+NTSTATUS ChunkStore::Store(const InstanceFile& source, const UNICODE_STRING& manifest,
+	ULONG bufferSize, CopyCounters* counters, StoreResult& result) {
+	PAGED_CODE();
+
+	RtlZeroMemory(&result, sizeof(result));
+	if (!IsReady())
+		return STATUS_DEVICE_NOT_READY;
+
+	auto instance = source.Instance;
+	BlockReader reader;
+	auto status = reader.Open(m_Filter, source, bufferSize, m_Tag, counters);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	UNICODE_STRING chunkName;
+	chunkName.Length = 0;
+	chunkName.MaximumLength = m_ChunkDir.Length + (ChunkDigestSize * 2 + TempSuffixLength) * sizeof(WCHAR);
+	auto entriesSize = ManifestBatch * sizeof(ChunkManifestEntry);
+	// one allocation for the chunk being built, the hash object, the chunk name and a batch of entries
+	auto buffer = (PUCHAR)ExAllocatePoolWithTag(PagedPool,
+		MaxChunkSize + m_HashObjectSize + chunkName.MaximumLength + entriesSize, m_Tag);
+	if (!buffer)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	auto chunk = buffer;
+	auto hashObject = chunk + MaxChunkSize;
+	chunkName.Buffer = (PWCH)(hashObject + m_HashObjectSize);
+	auto entries = (ChunkManifestEntry*)((PUCHAR)chunkName.Buffer + chunkName.MaximumLength);
+
+	BCRYPT_HASH_HANDLE hHash = nullptr;
+	StoreFile manifestFile{};
+	ChunkManifestHeader header{};
+	ULONG chunkSize = 0, batchCount = 0;
+	LONGLONG manifestOffset = sizeof(header) + source.Name.Length;
+	do {
+		status = BCryptCreateHash(m_Sha256, &hHash, hashObject, m_HashObjectSize, nullptr, 0, BCRYPT_HASH_REUSABLE_FLAG);
+		if (!NT_SUCCESS(status))
+			break;
+
+		status = CreateStoreFile(m_Filter, instance, (PUNICODE_STRING)&manifest, 0, manifestFile);
+		if (!NT_SUCCESS(status))
+			break;
+
+		header.Magic = ChunkManifestMagic;
+		header.Version = ChunkManifestVersion;
+		header.NameLength = source.Name.Length;
+		status = WriteStoreFile(instance, manifestFile, sizeof(header), source.Name.Buffer, source.Name.Length, counters, &result);
+		if (!NT_SUCCESS(status))
+			break;
+
+		Chunker chunker;
+		chunker.Init(MinChunkSize, AverageChunkBits, MaxChunkSize);
+		for (;;) {
+			PVOID block;
+			ULONG length;
+			status = reader.Next(block, length);
+			if (!NT_SUCCESS(status))
+				break;
+
+			// the final chunk ends with the file
+			auto end = length == 0;
+			ULONG pos = 0;
+			while (NT_SUCCESS(status) && (pos < length || (end && chunkSize > 0))) {
+				auto boundary = end;
+				if (!end) {
+					auto count = chunker.Next((PUCHAR)block + pos, length - pos, boundary);
+					RtlCopyMemory(chunk + chunkSize, (PUCHAR)block + pos, count);
+					chunkSize += count;
+					pos += count;
+				}
+				if (!boundary)
+					break;
+
+				auto& entry = entries[batchCount];
+				status = BCryptHashData(hHash, chunk, chunkSize, 0);
+				if (NT_SUCCESS(status))
+					status = BCryptFinishHash(hHash, entry.Digest, sizeof(entry.Digest), 0);
+				if (!NT_SUCCESS(status))
+					break;
+
+				bool stored;
+				status = StoreChunk(instance, *(ChunkDigest*)entry.Digest, chunk, chunkSize, &chunkName, counters, stored);
+				if (!NT_SUCCESS(status))
+					break;
+				if (stored)
+					result.NewChunks++;
+				else
+					result.DedupedChunks++;
+				entry.Size = chunkSize;
+				header.FileSize += chunkSize;
+				header.ChunkCount++;
+				chunkSize = 0;
+
+				if (++batchCount == ManifestBatch) {
+					status = WriteStoreFile(instance, manifestFile, manifestOffset, entries, batchCount * sizeof(ChunkManifestEntry), counters, &result);
+					manifestOffset += batchCount * sizeof(ChunkManifestEntry);
+					batchCount = 0;
+				}
+			}
+			if (end || !NT_SUCCESS(status))
+				break;
+		}
+		if (!NT_SUCCESS(status))
+			break;
+
+		if (batchCount > 0) {
+			status = WriteStoreFile(instance, manifestFile, manifestOffset, entries, batchCount * sizeof(ChunkManifestEntry), counters, &result);
+			if (!NT_SUCCESS(status))
+				break;
+		}
+
+		// the header goes last, once the counts are known
+		status = WriteStoreFile(instance, manifestFile, 0, &header, sizeof(header), counters, &result);
+	} while (false);
+
+	result.BytesRead = header.FileSize;
+	CloseStoreFile(instance, manifestFile, NT_SUCCESS(status));
+	if (hHash)
+		BCryptDestroyHash(hHash);
+	ExFreePoolWithTag(buffer, m_Tag);
+	return status;
+}
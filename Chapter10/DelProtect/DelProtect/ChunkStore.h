@@ -0,0 +1,64 @@
+#pragma once
+
+#include <fltKernel.h>
+#include <bcrypt.h>
+#include "BlockReader.h"
+#include "ChunkIndex.h"
+
+// what storing one file took
+struct StoreResult {
+	LONGLONG BytesRead;
+	LONGLONG BytesWritten;	// new chunks and the manifest
+	ULONG NewChunks;
+	ULONG DedupedChunks;	// already in the store
+};
+
+// A content-addressed, deduplicated store in a volume's backup directory.
+// Files are split into content-defined chunks; each chunk is kept once, in
+// <dir>\chunks\<SHA-256 in hex>, and a backup is a manifest listing its
+// chunks (see ChunkManifestHeader). The index remembers chunks known to be
+// in the store, so a backup of data stored before writes only its manifest;
+// on an index miss, the chunk file itself tells whether it exists already.
+// The ChunkStore itself must be in non-paged memory (its index lock is a
+// spin lock). Store at PASSIVE_LEVEL.
+class ChunkStore final {
+public:
+	static const ULONG MinChunkSize = 16 * 1024;
+	static const ULONG AverageChunkBits = 16;		// 64KB
+	static const ULONG MaxChunkSize = 256 * 1024;
+	static const ULONG IndexSlots = 16384;
+
+	// dir is the backup directory, ending with a backslash; sha256 must stay
+	// open until Free
+	NTSTATUS Init(PFLT_FILTER filter, PFLT_INSTANCE instance, PCUNICODE_STRING dir,
+		BCRYPT_ALG_HANDLE sha256, ULONG hashObjectSize, ULONG tag);
+	void Free();
+
+	bool IsReady() const {
+		return m_ChunkDir.Buffer != nullptr;
+	}
+
+	// stores source and writes its manifest to the full path manifest, which must not exist;
+	// the chunks go through source's instance
+	NTSTATUS Store(const InstanceFile& source, const UNICODE_STRING& manifest,
+		ULONG bufferSize, CopyCounters* counters, StoreResult& result);
+
+	ULONG IndexCount();
+
+private:
+	bool IsKnown(const ChunkDigest& digest);
+	void Remember(const ChunkDigest& digest);
+	NTSTATUS StoreChunk(PFLT_INSTANCE instance, const ChunkDigest& digest, PVOID data, ULONG size,
+		PUNICODE_STRING name, CopyCounters* counters, bool& stored);
+
+private:
+	ChunkIndex m_Index;			// only if m_IndexMemory was allocated
+	PVOID m_IndexMemory;
+	EX_SPIN_LOCK m_IndexLock;
+	UNICODE_STRING m_ChunkDir;	// ends with a backslash
+	PFLT_FILTER m_Filter;
+	BCRYPT_ALG_HANDLE m_Sha256;
+	ULONG m_HashObjectSize;
+	ULONG m_Tag;
+	LONG volatile m_TempSequence;	// names chunks being written
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+// No kernel dependencies, so the chunker can be built and measured anywhere.
+
+// 256 random 64-bit values for the rolling hash, generated at compile time (splitmix64)
+struct ChunkerGearTable {
+	constexpr ChunkerGearTable() : Table() {
+		unsigned long long state = 0x2545F4914F6CDD1DULL;
+		for (int i = 0; i < 256; i++) {
+			auto z = (state += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			Table[i] = z ^ (z >> 31);
+		}
+	}
+	unsigned long long Table[256];
+};
+
+inline constexpr ChunkerGearTable ChunkerGear{};
+
+// Splits a byte stream into content-defined chunks: a boundary is placed
+// where a rolling (gear) hash of the last bytes has its top bits clear, so
+// an insertion early in a file only changes the chunks around it and the
+// rest still match what was stored before. Chunks are never shorter than
+// the minimum (except the last) nor longer than the maximum.
+class Chunker final {
+public:
+	// sizes in bytes; averageBits picks the average chunk size, 1 << averageBits
+	void Init(unsigned minSize, unsigned averageBits, unsigned maxSize) {
+		m_MinSize = minSize;
+		m_MaxSize = maxSize;
+		m_Mask = ~0ULL << (64 - averageBits);
+		Reset();
+	}
+
+	void Reset() {
+		m_Hash = 0;
+		m_Size = 0;
+	}
+
+	// bytes of the current chunk seen so far
+	unsigned Size() const {
+		return m_Size;
+	}
+
+	// Consumes data up to the end of the current chunk. Returns how many
+	// bytes belong to it, and whether the chunk ends there; if not, all of
+	// data was consumed and the chunk continues in the next call.
+	unsigned Next(const unsigned char* data, unsigned length, bool& boundary) {
+		boundary = false;
+		unsigned i = 0;
+
+		// no boundary can fall inside the minimum size, so skip hashing it
+		if (m_Size < m_MinSize) {
+			auto skip = m_MinSize - m_Size;
+			if (skip > length)
+				skip = length;
+			m_Size += skip;
+			i = skip;
+		}
+
+		for (; i < length; i++) {
+			m_Hash = (m_Hash << 1) + ChunkerGear.Table[data[i]];
+			if (++m_Size >= m_MaxSize || (m_Hash & m_Mask) == 0) {
+				boundary = true;
+				Reset();
+				return i + 1;
+			}
+		}
+		return length;
+	}
+
+private:
+	unsigned long long m_Hash;
+	unsigned long long m_Mask;
+	unsigned m_Size;
+	unsigned m_MinSize, m_MaxSize;
+};
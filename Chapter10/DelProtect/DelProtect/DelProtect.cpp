@@ -4,142 +4,14 @@
 #include "FastMutex.h"
 #include "AutoLock.h"
 #include "DelProtectCommon.h"
-
-extern "C" NTSTATUS ZwQueryInformationProcess(
-	_In_      HANDLE           ProcessHandle,
-	_In_      PROCESSINFOCLASS ProcessInformationClass,
-	_Out_     PVOID            ProcessInformation,
-	_In_      ULONG            ProcessInformationLength,
-	_Out_opt_ PULONG           ReturnLength
-);
-
-NTSTATUS ntCopyFile(UNICODE_STRING uSrc, UNICODE_STRING uDst)
-{
-	// UNICODE_STRING uSrc = { 0 };
-	// UNICODE_STRING uDst = { 0 };
-	NTSTATUS ntStatus = 0;
-	HANDLE hSrcFile = NULL;
-	HANDLE hDstFile = NULL;
-	OBJECT_ATTRIBUTES objectSrcAttrib = { 0 };
-	OBJECT_ATTRIBUTES objectDstAttrib = { 0 };
-	//ULONG uReadSize = 0;
-	//ULONG uWriteSize = 0;
-	ULONG length = 0;
-	PVOID pBuffer = NULL;
-	IO_STATUS_BLOCK io_status = { 0 };
-	LARGE_INTEGER offset = { 0 };
-
-	// RtlInitUnicodeString(&uSrc, &src);
-	// RtlInitUnicodeString(&uDst, &dst);
-	// RtlCopyUnicodeString(&uSrc, &src);
-	// RtlCopyUnicodeString(&uDst, &dst);
-
-	InitializeObjectAttributes(
-		&objectSrcAttrib,
-		&uSrc,
-		OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
-		NULL,
-		NULL
-	);
-	InitializeObjectAttributes(
-		&objectDstAttrib,
-		&uDst,
-		OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
-		NULL,
-		NULL
-	);
-
-	ntStatus = ZwCreateFile(
-		&hSrcFile,
-		FILE_READ_DATA | FILE_READ_ATTRIBUTES,
-		&objectSrcAttrib,
-		&io_status,
-		NULL,
-		FILE_ATTRIBUTE_NORMAL,
-		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-		FILE_OPEN,
-		FILE_SYNCHRONOUS_IO_NONALERT,
-		NULL,
-		0
-	);
-	if (!NT_SUCCESS(ntStatus))
-	{
-		return ntStatus;
-	}
-
-	ntStatus = ZwCreateFile(
-		&hDstFile,
-		GENERIC_WRITE,
-		&objectDstAttrib,
-		&io_status,
-		NULL,
-		FILE_ATTRIBUTE_NORMAL,
-		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-		FILE_OPEN_IF,
-		FILE_SYNCHRONOUS_IO_NONALERT,
-		NULL,
-		0
-	);
-	if (!NT_SUCCESS(ntStatus))
-	{
-		ZwClose(hSrcFile);
-		return ntStatus;
-	}
-	pBuffer = ExAllocatePoolWithTag(PagedPool, 1024, 'ELIF');
-	if (NULL == pBuffer)
-	{
-		ZwClose(hSrcFile);
-		ZwClose(hDstFile);
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
-
-	while (1)
-	{
-		ntStatus = ZwReadFile(
-			hSrcFile,
-			NULL,
-			NULL,
-			NULL,
-			&io_status,
-			pBuffer,
-			PAGE_SIZE,
-			&offset,
-			NULL
-		);
-		if (!NT_SUCCESS(ntStatus))
-		{
-			if (STATUS_END_OF_FILE == ntStatus)
-			{
-				ntStatus = STATUS_SUCCESS;
-			}
-			break;
-		}
-		length = (ULONG)io_status.Information;
-
-		ntStatus = ZwWriteFile(
-			hDstFile,
-			NULL,
-			NULL,
-			NULL,
-			&io_status,
-			pBuffer,
-			length,
-			&offset,
-			NULL
-		);
-		if (!NT_SUCCESS(ntStatus))
-		{
-			break;
-		}
-		offset.QuadPart += length;
-
-	}
-	ExFreePool(pBuffer);
-	ZwClose(hSrcFile);
-	ZwClose(hDstFile);
-	return ntStatus;
-
-}
+#include "kstring_view.h"
+#include "ProcessCache.h"
+#include "ExeNameSet.h"
+#include "Snapshot.h"
+#include "BackupQueue.h"
+#include "BlockReader.h"
+#include "BackupPolicy.h"
+#include "VolumeContext.h"
 
 #pragma prefast(disable:__WARNING_ENCODE_MEMBER_FUNCTION_POINTER, "Not valid for kernel mode drivers")
 
@@ -153,11 +25,38 @@ ULONG_PTR OperationStatusCtx = 1;
 
 ULONG gTraceFlags = 0;
 
-const int MaxExecutables = 32;
+// adjustable with IOCTL_DELPROTECT_SET_EXE_LIMIT
+const ULONG DefaultMaxExecutables = 256;
+// longest executable name accepted, in characters
+const ULONG MaxExeNameLength = 260;
 
-WCHAR* ExeNames[MaxExecutables];
-int ExeNamesCount;
+// lookups pin the current set without locking; writers build a new set
+// under ExeNamesLock and publish it
+SnapshotSlot<ExeNameSet> ExeNames;
+ULONG MaxExecutables = DefaultMaxExecutables;
 FastMutex ExeNamesLock;
+// bumped whenever the executable list changes, invalidating cached verdicts
+LONG volatile ExeGeneration;
+ProcessCache Processes;
+// backup copies run on worker threads; a full queue copies on the deleting thread
+const ULONG BackupWorkers = 2;
+const ULONG BackupQueueLimit = 64;
+BackupQueue Backups;
+// backups kept by a hard link instead of a copy, and links that fell back to one
+LONG volatile Linked, LinkFailed;
+// under the root of every volume; the instance context holds the full path
+#define BackupDirName L"\\$RECYCLE.BIN\\"
+// adjustable with IOCTL_DELPROTECT_SET_COPY_BUFFER
+LONG volatile CopyBufferSize = DefaultCopyBufferSize;
+// backups kept in the chunk stores, and the chunks they wrote or found there
+LONG volatile Stored, ChunksStored, ChunksDeduped;
+// nonzero to store backups that could be links; set with IOCTL_DELPROTECT_SET_DEDUP
+LONG volatile DedupAll;
+// for chunk digests; if it can't be opened, backups that aren't links are copies
+BCRYPT_ALG_HANDLE Sha256;
+ULONG HashObjectSize;
+// keeps backups of files with the same name apart
+LONG volatile BackupSequence;
 
 
 #define PT_DBG_PRINT( _dbgLevel, _string )          \
@@ -169,7 +68,19 @@ FastMutex ExeNamesLock;
 	Prototypes
 *************************************************************************/
 
-bool FindExecutable(PCWSTR name);
+bool FindExecutable(const kstring_view& name);
+NTSTATUS UpdateExecutables(const kstring_view& add, const kstring_view& remove);
+void PublishExecutables(ExeNameSet* next);
+bool IsProcessProtected(PFLT_CALLBACK_DATA Data);
+void OnProcessNotify(_Inout_ PEPROCESS Process, _In_ HANDLE ProcessId, _Inout_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo);
+NTSTATUS BackupFile(const InstanceFile& source, const InstanceFile& target, ULONG flags, CopyCounters* counters);
+NTSTATUS BackupDeletedFile(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, bool& deleteAllowed);
+NTSTATUS SetupVolumeContext(PCFLT_RELATED_OBJECTS FltObjects);
+void RecordBackup(VolumeContext* context, NTSTATUS status, ULONGLONG start, LONGLONG bytesCopied, BackupMethod method);
+void VolumeContextCleanup(PFLT_CONTEXT Context, FLT_CONTEXT_TYPE ContextType);
+NTSTATUS OpenSha256();
+void CloseSha256();
+NTSTATUS GetVolumeStats(VolumeBackupStats* stats, ULONG count, ULONG& returned);
 
 
 EXTERN_C_START
@@ -279,6 +190,11 @@ EXTERN_C_END
 //  operation registration
 //
 
+CONST FLT_CONTEXT_REGISTRATION Contexts[] = {
+	{ FLT_INSTANCE_CONTEXT, 0, VolumeContextCleanup, FLT_VARIABLE_SIZED_CONTEXTS, DRIVER_TAG },
+	{ FLT_CONTEXT_END }
+};
+
 CONST FLT_OPERATION_REGISTRATION Callbacks[] = {
 	{ IRP_MJ_CREATE, 0, DelProtectPreCreate, nullptr },
 	{ IRP_MJ_SET_INFORMATION, 0, DelProtectPreSetInformation, nullptr },
@@ -294,7 +210,7 @@ CONST FLT_REGISTRATION FilterRegistration = {
 	sizeof(FLT_REGISTRATION),
 	FLT_REGISTRATION_VERSION,
 	0,                       //  Flags
-	nullptr,                 //  Context
+	Contexts,                //  Context
 	Callbacks,               //  Operation callbacks
 	DelProtectUnload,                   //  MiniFilterUnload
 	DelProtectInstanceSetup,            //  InstanceSetup
@@ -336,16 +252,23 @@ Return Value:
 
 --*/
 {
-	UNREFERENCED_PARAMETER(FltObjects);
 	UNREFERENCED_PARAMETER(Flags);
 	UNREFERENCED_PARAMETER(VolumeDeviceType);
-	UNREFERENCED_PARAMETER(VolumeFilesystemType);
 
 	PAGED_CODE();
 
 	PT_DBG_PRINT(PTDBG_TRACE_ROUTINES,
 		("DelProtect!DelProtectInstanceSetup: Entered\n"));
 
+	// nothing to back up to on a volume without a file system
+	if (VolumeFilesystemType == FLT_FSTYPE_RAW)
+		return STATUS_FLT_DO_NOT_ATTACH;
+
+	// attach anyway: deletes are still intercepted, only their backups fail
+	auto status = SetupVolumeContext(FltObjects);
+	if (!NT_SUCCESS(status))
+		KdPrint(("DelProtect: no backup directory for volume (0x%08X)\n", status));
+
 	return STATUS_SUCCESS;
 }
 
@@ -503,6 +426,8 @@ Return Value:
 	UNICODE_STRING devName = RTL_CONSTANT_STRING(L"\\device\\delprotect");
 	UNICODE_STRING symLink = RTL_CONSTANT_STRING(L"\\??\\delprotect");
 	auto symLinkCreated = false;
+	bool processCallbacks = false;
+	bool backupsStarted = false;
 
 	do {
 		status = IoCreateDevice(DriverObject, 0, &devName, FILE_DEVICE_UNKNOWN, 0, FALSE, &DeviceObject);
@@ -529,6 +454,30 @@ Return Value:
 		DriverObject->MajorFunction[IRP_MJ_CREATE] = DriverObject->MajorFunction[IRP_MJ_CLOSE] = DelProtectCreateClose;
 		DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = DelProtectDeviceControl;
 		ExeNamesLock.Init();
+		Processes.Init();
+		status = ExeNames.Init(DRIVER_TAG);
+		if (!NT_SUCCESS(status))
+			break;
+
+		// process exits must drop their cached verdicts before the ID is reused
+		status = PsSetCreateProcessNotifyRoutineEx(OnProcessNotify, FALSE);
+		if (!NT_SUCCESS(status)) {
+			KdPrint(("DelProtect: failed to register process callback (0x%08X)\n", status));
+			break;
+		}
+		processCallbacks = true;
+
+		status = Backups.Init(gFilterHandle, BackupWorkers, BackupQueueLimit, BackupFile, DRIVER_TAG);
+		if (!NT_SUCCESS(status)) {
+			KdPrint(("DelProtect: failed to start backup workers (0x%08X)\n", status));
+			break;
+		}
+		backupsStarted = true;
+
+		// volumes attached from here on get chunk stores
+		auto hashStatus = OpenSha256();
+		if (!NT_SUCCESS(hashStatus))
+			KdPrint(("DelProtect: no SHA-256 provider, chunk stores disabled (0x%08X)\n", hashStatus));
 
 		//
 		//  Start filtering i/o
@@ -538,8 +487,14 @@ Return Value:
 	} while (false);
 
 	if (!NT_SUCCESS(status)) {
+		if (processCallbacks)
+			PsSetCreateProcessNotifyRoutineEx(OnProcessNotify, TRUE);
+		ExeNames.Shutdown();
+		if (backupsStarted)
+			Backups.Shutdown();
 		if (gFilterHandle)
 			FltUnregisterFilter(gFilterHandle);
+		CloseSha256();
 		if (symLinkCreated)
 			IoDeleteSymbolicLink(&symLink);
 		if (DeviceObject)
@@ -579,7 +534,15 @@ Return Value:
 	PT_DBG_PRINT(PTDBG_TRACE_ROUTINES,
 		("DelProtect!DelProtectUnload: Entered\n"));
 
+	// queued backups hold instance references, which unregistering waits for,
+	// so the workers are stopped first. The filter still sees deletes until
+	// FltUnregisterFilter returns; Backup copies those on the deleting thread,
+	// so a delete in that window waits for its whole copy
+	Backups.Shutdown();
 	FltUnregisterFilter(gFilterHandle);
+	// the instance contexts, and the chunk stores in them, are gone by now
+	CloseSha256();
+	PsSetCreateProcessNotifyRoutineEx(OnProcessNotify, TRUE);
 
 	return STATUS_SUCCESS;
 }
@@ -788,9 +751,11 @@ NTSTATUS DelProtectCreateClose(PDEVICE_OBJECT, PIRP Irp) {
 NTSTATUS DelProtectDeviceControl(PDEVICE_OBJECT, PIRP Irp) {
 	auto stack = IoGetCurrentIrpStackLocation(Irp);
 	auto status = STATUS_SUCCESS;
+	ULONG_PTR len = 0;
 
 	switch (stack->Parameters.DeviceIoControl.IoControlCode) {
 	case IOCTL_DELPROTECT_ADD_EXE:
+	case IOCTL_DELPROTECT_REMOVE_EXE:
 	{
 		auto name = (WCHAR*)Irp->AssociatedIrp.SystemBuffer;
 		if (!name) {
@@ -798,60 +763,94 @@ NTSTATUS DelProtectDeviceControl(PDEVICE_OBJECT, PIRP Irp) {
 			break;
 		}
 
-		if (FindExecutable(name)) {
+		auto nameLen = (ULONG)::wcsnlen(name, stack->Parameters.DeviceIoControl.InputBufferLength / sizeof(WCHAR));
+		if (nameLen == 0 || nameLen > MaxExeNameLength) {
+			status = STATUS_INVALID_PARAMETER;
 			break;
 		}
 
-		AutoLock locker(ExeNamesLock);
-		if (ExeNamesCount == MaxExecutables) {
-			status = STATUS_TOO_MANY_NAMES;
+		kstring_view exeName(name, nameLen);
+		if (stack->Parameters.DeviceIoControl.IoControlCode == IOCTL_DELPROTECT_ADD_EXE)
+			status = UpdateExecutables(exeName, kstring_view());
+		else
+			status = UpdateExecutables(kstring_view(), exeName);
+		break;
+	}
+
+	case IOCTL_DELPROTECT_SET_EXE_LIMIT:
+	{
+		auto limit = (ULONG*)Irp->AssociatedIrp.SystemBuffer;
+		if (!limit || stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG) || *limit == 0) {
+			status = STATUS_INVALID_PARAMETER;
 			break;
 		}
 
-		for (int i = 0; i < MaxExecutables; i++) {
-			if (ExeNames[i] == nullptr) {
-				auto len = (::wcslen(name) + 1) * sizeof(WCHAR);
-				auto buffer = (WCHAR*)ExAllocatePoolWithTag(PagedPool, len, DRIVER_TAG);
-				if (!buffer) {
-					status = STATUS_INSUFFICIENT_RESOURCES;
-					break;
-				}
-				::wcscpy_s(buffer, len / sizeof(WCHAR), name);
-				ExeNames[i] = buffer;
-				++ExeNamesCount;
-				break;
-			}
+		// existing names are kept, the new limit only applies to later adds
+		AutoLock locker(ExeNamesLock);
+		MaxExecutables = *limit;
+		break;
+	}
+
+	case IOCTL_DELPROTECT_CLEAR:
+		ClearAll();
+		break;
+
+	case IOCTL_DELPROTECT_SET_COPY_BUFFER:
+	{
+		auto size = (ULONG*)Irp->AssociatedIrp.SystemBuffer;
+		if (!size || stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG)) {
+			status = STATUS_INVALID_PARAMETER;
+			break;
 		}
+
+		// copies already running keep their buffers
+		InterlockedExchange(&CopyBufferSize, (LONG)NormalizeCopyBufferSize(*size));
 		break;
 	}
 
-	case IOCTL_DELPROTECT_REMOVE_EXE:
+	case IOCTL_DELPROTECT_SET_DEDUP:
 	{
-		auto name = (WCHAR*)Irp->AssociatedIrp.SystemBuffer;
-		if (!name) {
+		auto dedup = (ULONG*)Irp->AssociatedIrp.SystemBuffer;
+		if (!dedup || stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG)) {
 			status = STATUS_INVALID_PARAMETER;
 			break;
 		}
 
-		AutoLock locker(ExeNamesLock);
-		auto found = false;
-		for (int i = 0; i < MaxExecutables; i++) {
-			if (::_wcsicmp(ExeNames[i], name) == 0) {
-				ExFreePool(ExeNames[i]);
-				ExeNames[i] = nullptr;
-				--ExeNamesCount;
-				found = true;
-				break;
-			}
+		InterlockedExchange(&DedupAll, *dedup ? 1 : 0);
+		break;
+	}
+
+	case IOCTL_DELPROTECT_GET_VOLUMES:
+	{
+		auto count = stack->Parameters.DeviceIoControl.OutputBufferLength / sizeof(VolumeBackupStats);
+		if (count == 0) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
 		}
-		if (!found)
-			status = STATUS_NOT_FOUND;
+
+		ULONG returned;
+		status = GetVolumeStats((VolumeBackupStats*)Irp->AssociatedIrp.SystemBuffer, (ULONG)count, returned);
+		len = returned * sizeof(VolumeBackupStats);
 		break;
 	}
 
-	case IOCTL_DELPROTECT_CLEAR:
-		ClearAll();
+	case IOCTL_DELPROTECT_GET_BACKUP_STATS:
+	{
+		if (stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(BackupStats)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		auto stats = (BackupStats*)Irp->AssociatedIrp.SystemBuffer;
+		Backups.GetStats(stats);
+		stats->Linked = Linked;
+		stats->LinkFailed = LinkFailed;
+		stats->Stored = Stored;
+		stats->ChunksStored = ChunksStored;
+		stats->ChunksDeduped = ChunksDeduped;
+		len = sizeof(BackupStats);
 		break;
+	}
 
 	default:
 		status = STATUS_INVALID_DEVICE_REQUEST;
@@ -859,149 +858,536 @@ NTSTATUS DelProtectDeviceControl(PDEVICE_OBJECT, PIRP Irp) {
 	}
 
 	Irp->IoStatus.Status = status;
-	Irp->IoStatus.Information = 0;
+	Irp->IoStatus.Information = len;
 	IoCompleteRequest(Irp, IO_NO_INCREMENT);
 	return status;
 
 }
 
-bool FindExecutable(PCWSTR name) {
+bool FindExecutable(const kstring_view& name) {
+	SnapshotRef<ExeNameSet> names(ExeNames);
+	return names && names->Contains(name);
+}
+
+// publishes a copy of the current set with add added and/or remove removed
+NTSTATUS UpdateExecutables(const kstring_view& add, const kstring_view& remove) {
 	AutoLock locker(ExeNamesLock);
-	if (ExeNamesCount == 0)
-		return false;
 
-	for (int i = 0; i < MaxExecutables; i++)
-		if (ExeNames[i] && ::_wcsicmp(ExeNames[i], name) == 0)
-			return true;
-	return false;
+	auto current = ExeNames.Current();
+	ULONG count = 0, nameChars = 0;
+	if (current) {
+		count = current->Count();
+		nameChars = current->NameChars();
+	}
+
+	auto hasRemove = !remove.IsEmpty() && current && current->Contains(remove);
+	if (!remove.IsEmpty() && !hasRemove)
+		return STATUS_NOT_FOUND;
+	auto hasAdd = !add.IsEmpty() && !(current && current->Contains(add));
+	if (!hasAdd && !hasRemove)
+		return STATUS_SUCCESS;	// already protected
+
+	if (hasAdd) {
+		if (count - (hasRemove ? 1 : 0) >= MaxExecutables)
+			return STATUS_TOO_MANY_NAMES;
+		count++;
+		nameChars += add.Length();
+	}
+	if (hasRemove) {
+		count--;
+		nameChars -= remove.Length();
+	}
+
+	ExeNameSet* next = nullptr;
+	if (count > 0) {
+		next = ExeNameSet::Create(count, nameChars, DRIVER_TAG);
+		if (!next)
+			return STATUS_INSUFFICIENT_RESOURCES;
+
+		for (ULONG i = 0; current && i < current->Count(); i++) {
+			auto name = current->Name(i);
+			if (!hasRemove || !name.EqualsNoCase(remove))
+				next->Add(name);
+		}
+		if (hasAdd)
+			next->Add(add);
+	}
+
+	PublishExecutables(next);
+	return STATUS_SUCCESS;
+}
+
+// callers hold ExeNamesLock
+void PublishExecutables(ExeNameSet* next) {
+	// returns once no lookup can see the old set anymore
+	ExeNameSet::Free(ExeNames.Publish(next));
+
+	// verdicts computed against the old set are stale now
+	InterlockedIncrement(&ExeGeneration);
 }
 
 void ClearAll() {
 	AutoLock locker(ExeNamesLock);
-	for (int i = 0; i < MaxExecutables; i++) {
-		if (ExeNames[i]) {
-			ExFreePool(ExeNames[i]);
-			ExeNames[i] = nullptr;
+	PublishExecutables(nullptr);
+}
+
+// whether the process a request came from runs one of the protected
+// executables; the answer is cached per process until the list changes
+bool IsProcessProtected(PFLT_CALLBACK_DATA Data) {
+	auto process = Data->Thread ? PsGetThreadProcess(Data->Thread) : PsGetCurrentProcess();
+	auto pid = PsGetProcessId(process);
+
+	// sampled before the set is searched, so a concurrent change leaves a stale entry
+	auto generation = (ULONG)ReadAcquire(&ExeGeneration);
+	bool isProtected;
+	if (Processes.Lookup(pid, generation, isProtected))
+		return isProtected;
+
+	PUNICODE_STRING imageName;
+	if (!NT_SUCCESS(SeLocateProcessImageName(process, &imageName)))
+		return false;
+
+	KdPrint(("Delete operation from %wZ\n", imageName));
+	isProtected = FindExecutable(kstring_view(imageName).FileName());
+	ExFreePool(imageName);
+
+	Processes.Insert(pid, generation, isProtected);
+	return isProtected;
+}
+
+// fills the cache as processes start and empties their slot when they exit
+void OnProcessNotify(PEPROCESS, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateInfo) {
+	if (!CreateInfo) {
+		Processes.Remove(ProcessId);
+		return;
+	}
+
+	if (CreateInfo->ImageFileName) {
+		auto generation = (ULONG)ReadAcquire(&ExeGeneration);
+		auto isProtected = FindExecutable(kstring_view(CreateInfo->ImageFileName).FileName());
+		Processes.Insert(ProcessId, generation, isProtected);
+	}
+}
+
+// flags is the BackupMethod, Store or Copy; a stored backup's target is its manifest
+NTSTATUS BackupFile(const InstanceFile& source, const InstanceFile& target, ULONG flags, CopyCounters* counters) {
+	auto bufferSize = (ULONG)ReadNoFence(&CopyBufferSize);
+	auto method = (BackupMethod)flags;
+
+	// the target is on the source's volume, and its instance is referenced while the copy is queued
+	VolumeContext* context;
+	auto status = FltGetInstanceContext(target.Instance, (PFLT_CONTEXT*)&context);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	auto start = KeQueryInterruptTime();
+	if (method == BackupMethod::Store) {
+		StoreResult result;
+		status = context->Store.Store(source, target.Name, bufferSize, counters, result);
+		if (NT_SUCCESS(status)) {
+			InterlockedIncrement(&Stored);
+			InterlockedAdd(&ChunksStored, result.NewChunks);
+			InterlockedAdd(&ChunksDeduped, result.DedupedChunks);
+			InterlockedAdd(&context->ChunksStored, result.NewChunks);
+			InterlockedAdd(&context->ChunksDeduped, result.DedupedChunks);
+			InterlockedAdd64(&context->BytesWritten, result.BytesWritten);
 		}
+		RecordBackup(context, status, start, result.BytesRead, method);
+	}
+	else {
+		LONGLONG copied = 0;
+		status = CopyFileContents(gFilterHandle, source, target, bufferSize, DRIVER_TAG, counters, &copied);
+		if (NT_SUCCESS(status))
+			InterlockedAdd64(&context->BytesWritten, copied);
+		RecordBackup(context, status, start, copied, method);
 	}
-	ExeNamesCount = 0;
+	FltReleaseContext(context);
+	return status;
 }
 
-void DelProtectUnloadDriver(PDRIVER_OBJECT DriverObject) {
-	ClearAll();
-	UNICODE_STRING symLink = RTL_CONSTANT_STRING(L"\\??\\delprotect");
-	IoDeleteSymbolicLink(&symLink);
-	IoDeleteDevice(DriverObject->DeviceObject);
+void RecordBackup(VolumeContext* context, NTSTATUS status, ULONGLONG start, LONGLONG bytesCopied, BackupMethod method) {
+	if (!NT_SUCCESS(status)) {
+		InterlockedIncrement(&context->Failed);
+		return;
+	}
+
+	auto elapsed = (LONG64)(KeQueryInterruptTime() - start);
+	InterlockedIncrement(method == BackupMethod::Link ? &context->Linked :
+		method == BackupMethod::Store ? &context->Stored : &context->Copied);
+	InterlockedAdd64(&context->BytesCopied, bytesCopied);
+	InterlockedAdd64(&context->TotalTime, elapsed);
+	BackupQueue::UpdateMax(&context->MaxTime, elapsed);
 }
 
+NTSTATUS OpenSha256() {
+	auto status = BCryptOpenAlgorithmProvider(&Sha256, BCRYPT_SHA256_ALGORITHM, nullptr, 0);
+	if (!NT_SUCCESS(status)) {
+		Sha256 = nullptr;
+		return status;
+	}
 
-_Use_decl_annotations_
-FLT_PREOP_CALLBACK_STATUS DelProtectPreCreate(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PVOID*) {
-	UNREFERENCED_PARAMETER(FltObjects);
+	ULONG size;
+	status = BCryptGetProperty(Sha256, BCRYPT_OBJECT_LENGTH, (PUCHAR)&HashObjectSize, sizeof(HashObjectSize), &size, 0);
+	if (!NT_SUCCESS(status))
+		CloseSha256();
+	return status;
+}
 
-	if (Data->RequestorMode == KernelMode)
-		return FLT_PREOP_SUCCESS_NO_CALLBACK;
+void CloseSha256() {
+	if (Sha256) {
+		BCryptCloseAlgorithmProvider(Sha256, 0);
+		Sha256 = nullptr;
+	}
+}
 
-	auto& params = Data->Iopb->Parameters.Create;
-	auto returnStatus = FLT_PREOP_SUCCESS_NO_CALLBACK;
+void VolumeContextCleanup(PFLT_CONTEXT Context, FLT_CONTEXT_TYPE ContextType) {
+	UNREFERENCED_PARAMETER(ContextType);
 
-	if (params.Options & FILE_DELETE_ON_CLOSE) {
-		// delete operation
-		KdPrint(("Delete on close: %wZ\n", &FltObjects->FileObject->FileName));
+	((VolumeContext*)Context)->Store.Free();
+}
 
-		auto size = 512;	// some arbitrary size
-		auto processName = (UNICODE_STRING*)ExAllocatePool(PagedPool, size);
-		if (processName == nullptr)
-			return FLT_PREOP_SUCCESS_NO_CALLBACK;
+// creates the backup directory if needed; dir ends with a backslash
+NTSTATUS CreateBackupDir(PFLT_INSTANCE instance, PCUNICODE_STRING dir) {
+	UNICODE_STRING name = *dir;
+	name.Length -= sizeof(WCHAR);
+
+	OBJECT_ATTRIBUTES attr;
+	IO_STATUS_BLOCK ioStatus;
+	InitializeObjectAttributes(&attr, &name, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+	HANDLE hDir;
+	auto status = FltCreateFileEx2(gFilterHandle, instance, &hDir, nullptr, FILE_LIST_DIRECTORY | SYNCHRONIZE,
+		&attr, &ioStatus, nullptr, FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_OPEN_IF,
+		FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT, nullptr, 0, 0, nullptr);
+	if (NT_SUCCESS(status))
+		FltClose(hDir);
+	return status;
+}
 
-		RtlZeroMemory(processName, size);	// ensure string will be NULL-terminated
-		auto status = ZwQueryInformationProcess(NtCurrentProcess(), ProcessImageFileName,
-			processName, size - sizeof(WCHAR), nullptr);
+// gives a new instance its context, with the backup directory on its own volume
+NTSTATUS SetupVolumeContext(PCFLT_RELATED_OBJECTS FltObjects) {
+	ULONG nameSize = 0;
+	auto status = FltGetVolumeName(FltObjects->Volume, nullptr, &nameSize);
+	if (status != STATUS_BUFFER_TOO_SMALL)
+		return NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL : status;
+
+	UNICODE_STRING dirName = RTL_CONSTANT_STRING(BackupDirName);
+	if (nameSize + dirName.Length > MAXUSHORT)
+		return STATUS_NAME_TOO_LONG;
+
+	// non-paged: the chunk store's index lock is a spin lock
+	VolumeContext* context;
+	status = FltAllocateContext(gFilterHandle, FLT_INSTANCE_CONTEXT,
+		sizeof(VolumeContext) + nameSize + dirName.Length, NonPagedPoolNx, (PFLT_CONTEXT*)&context);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	RtlZeroMemory(context, sizeof(VolumeContext));
+	context->VolumeName.Buffer = context->Names;
+	context->VolumeName.MaximumLength = (USHORT)nameSize;
+	status = FltGetVolumeName(FltObjects->Volume, &context->VolumeName, nullptr);
+	if (NT_SUCCESS(status)) {
+		context->BackupDir.Buffer = context->Names;
+		context->BackupDir.MaximumLength = (USHORT)(nameSize + dirName.Length);
+		RtlCopyUnicodeString(&context->BackupDir, &context->VolumeName);
+		RtlAppendUnicodeStringToString(&context->BackupDir, &dirName);
+
+		auto dirStatus = CreateBackupDir(FltObjects->Instance, &context->BackupDir);
+		context->BackupDirReady = NT_SUCCESS(dirStatus);
+		if (!context->BackupDirReady)
+			KdPrint(("DelProtect: failed to create %wZ (0x%08X)\n", &context->BackupDir, dirStatus));
+
+		if (context->BackupDirReady && Sha256) {
+			auto storeStatus = context->Store.Init(gFilterHandle, FltObjects->Instance, &context->BackupDir,
+				Sha256, HashObjectSize, DRIVER_TAG);
+			if (!NT_SUCCESS(storeStatus))
+				KdPrint(("DelProtect: no chunk store in %wZ (0x%08X)\n", &context->BackupDir, storeStatus));
+		}
 
-		if (NT_SUCCESS(status)) {
-			KdPrint(("Delete operation from %wZ\n", processName));
+		status = FltSetInstanceContext(FltObjects->Instance, FLT_SET_CONTEXT_KEEP_IF_EXISTS, context, nullptr);
+	}
+	FltReleaseContext(context);
+	return status;
+}
 
-			auto exeName = ::wcsrchr(processName->Buffer, L'\\');
-			NT_ASSERT(exeName);
+// fills stats with one entry per volume DelProtect is attached to, as many as fit
+NTSTATUS GetVolumeStats(VolumeBackupStats* stats, ULONG count, ULONG& returned) {
+	returned = 0;
+	ULONG instanceCount = 0;
+	auto status = FltEnumerateInstances(nullptr, gFilterHandle, nullptr, 0, &instanceCount);
+	if (status != STATUS_BUFFER_TOO_SMALL)
+		return status;
+
+	PFLT_INSTANCE* instances;
+	for (;;) {
+		instances = (PFLT_INSTANCE*)ExAllocatePoolWithTag(PagedPool, instanceCount * sizeof(PFLT_INSTANCE), DRIVER_TAG);
+		if (!instances)
+			return STATUS_INSUFFICIENT_RESOURCES;
+
+		// more volumes may have shown up meanwhile
+		status = FltEnumerateInstances(nullptr, gFilterHandle, instances, instanceCount, &instanceCount);
+		if (status != STATUS_BUFFER_TOO_SMALL)
+			break;
+		ExFreePoolWithTag(instances, DRIVER_TAG);
+	}
 
-			if (exeName && FindExecutable(exeName + 1)) {	// skip backslash
+	if (NT_SUCCESS(status)) {
+		for (ULONG i = 0; i < instanceCount; i++) {
+			VolumeContext* context;
+			if (returned < count && NT_SUCCESS(FltGetInstanceContext(instances[i], (PFLT_CONTEXT*)&context))) {
+				auto& entry = stats[returned++];
+				auto chars = min((ULONG)context->VolumeName.Length / sizeof(WCHAR), (ULONG)MaxVolumeNameSize - 1);
+				RtlCopyMemory(entry.VolumeName, context->VolumeName.Buffer, chars * sizeof(WCHAR));
+				entry.VolumeName[chars] = L'\0';
+				entry.BackupDirReady = context->BackupDirReady;
+				entry.Linked = context->Linked;
+				entry.Copied = context->Copied;
+				entry.Stored = context->Stored;
+				entry.Failed = context->Failed;
+				entry.ChunksStored = context->ChunksStored;
+				entry.ChunksDeduped = context->ChunksDeduped;
+				entry.IndexEntries = context->Store.IndexCount();
+				entry.BytesCopied = context->BytesCopied;
+				entry.BytesWritten = context->BytesWritten;
+				entry.TotalTime = context->TotalTime;
+				entry.MaxTime = context->MaxTime;
+				FltReleaseContext(context);
+			}
+			FltObjectDereference(instances[i]);
+		}
+		if (returned < instanceCount)
+			status = STATUS_BUFFER_OVERFLOW;
+	}
+	ExFreePoolWithTag(instances, DRIVER_TAG);
+	return status;
+}
 
-				//UNICODE_STRING sFileName = (UNICODE_STRING)Data->Iopb->TargetFileObject->FileName;
-				//UNICODE_STRING sourceFileName = RTL_CONSTANT_STRING(L"\\??\\C:\\" sFileName);
-				//KdPrint(("Delete on close: %wZ\n", &sourceFileName));
+// gathers what ChooseBackupMethod looks at
+NTSTATUS QueryBackupCandidate(PFLT_INSTANCE instance, PFILE_OBJECT file, bool sameVolume, BackupCandidate& candidate) {
+	RtlZeroMemory(&candidate, sizeof(candidate));
+	candidate.SameVolume = sameVolume;
 
-				PFLT_FILE_NAME_INFORMATION nameInfo = nullptr;
+	FILE_STANDARD_INFORMATION info;
+	auto status = FltQueryInformationFile(instance, file, &info, sizeof(info), FileStandardInformation, nullptr);
+	if (!NT_SUCCESS(status))
+		return status;
+	candidate.Directory = info.Directory;
+	candidate.LinkCount = info.NumberOfLinks;
+
+	if (sameVolume) {
+		// room for the file system name too, though only the attributes are needed
+		UCHAR buffer[sizeof(FILE_FS_ATTRIBUTE_INFORMATION) + 32];
+		IO_STATUS_BLOCK ioStatus;
+		status = FltQueryVolumeInformation(instance, &ioStatus, buffer, sizeof(buffer), FileFsAttributeInformation);
+		if (NT_SUCCESS(status) || status == STATUS_BUFFER_OVERFLOW)
+			candidate.VolumeSupportsLinks = (((FILE_FS_ATTRIBUTE_INFORMATION*)buffer)->FileSystemAttributes & FILE_SUPPORTS_HARD_LINKS) != 0;
+	}
+	return STATUS_SUCCESS;
+}
 
-				FltGetFileNameInformation(Data, FLT_FILE_NAME_QUERY_DEFAULT | FLT_FILE_NAME_NORMALIZED, &nameInfo);
-				FltParseFileNameInformation(nameInfo);
+// gives file the additional name target, on the same volume
+NTSTATUS LinkFile(PFLT_INSTANCE instance, PFILE_OBJECT file, PCUNICODE_STRING target) {
+	auto size = FIELD_OFFSET(FILE_LINK_INFORMATION, FileName) + target->Length;
+	auto info = (FILE_LINK_INFORMATION*)ExAllocatePoolWithTag(PagedPool, size, DRIVER_TAG);
+	if (!info)
+		return STATUS_INSUFFICIENT_RESOURCES;
 
-				POBJECT_NAME_INFORMATION ObjectNameInformation = nullptr;
-				IoQueryFileDosDeviceName(Data->Iopb->TargetFileObject, &ObjectNameInformation);
-				KdPrint(("Dos Letter Name: %wZ\n", ObjectNameInformation->Name));
+	// backup names are unique, so an existing one means something is wrong
+	info->ReplaceIfExists = FALSE;
+	info->RootDirectory = nullptr;
+	info->FileNameLength = target->Length;
+	RtlCopyMemory(info->FileName, target->Buffer, target->Length);
+	auto status = FltSetInformationFile(instance, file, info, size, FileLinkInformation);
+	ExFreePoolWithTag(info, DRIVER_TAG);
+	return status;
+}
 
-				auto dosName = ObjectNameInformation->Name;
-				auto NameLength = (USHORT)dosName.MaximumLength + Data->Iopb->TargetFileObject->FileName.MaximumLength + 2;
-				auto NameBuffer = ExAllocatePoolWithTag(PagedPool, NameLength, DRIVER_TAG);
-				if (NameBuffer == nullptr) {
-					KdPrint(("Failed to allocate memory\n"));
-					return FLT_PREOP_COMPLETE;
-				}
-				UNICODE_STRING NameString;
-				NameString.Length = 0;
-				NameString.MaximumLength = (USHORT)NameLength;
-				NameString.Buffer = (PWCH)NameBuffer;
+// Makes the backup name <dir><name>.<time><sequence><suffix>, so backups of
+// files with the same name, or of the same file deleted again, don't replace
+// each other. The time sorts a file's backups; the sequence keeps apart two
+// taken within the same clock tick. The caller frees target's buffer.
+NTSTATUS MakeBackupName(PCUNICODE_STRING dir, PCUNICODE_STRING name, PCWSTR suffix, UNICODE_STRING& target) {
+	const USHORT Digits = 16 + 8;
+	UNICODE_STRING suffixName;
+	RtlInitUnicodeString(&suffixName, suffix);
+	ULONG size = dir->Length + name->Length + (1 + Digits) * sizeof(WCHAR) + suffixName.Length;
+	if (size > MAXUSHORT)
+		return STATUS_NAME_TOO_LONG;
+
+	target.Length = 0;
+	target.MaximumLength = (USHORT)size;
+	target.Buffer = (PWCH)ExAllocatePoolWithTag(PagedPool, size, DRIVER_TAG);
+	if (!target.Buffer)
+		return STATUS_INSUFFICIENT_RESOURCES;
 
-				UNICODE_STRING symString = RTL_CONSTANT_STRING(L"\\??\\");
-				RtlCopyUnicodeString(&NameString, &symString);
-				RtlAppendUnicodeStringToString(&NameString, &dosName);
-				RtlAppendUnicodeStringToString(&NameString, &Data->Iopb->TargetFileObject->FileName);
+	RtlCopyUnicodeString(&target, dir);
+	RtlAppendUnicodeStringToString(&target, name);
+
+	LARGE_INTEGER time;
+	KeQuerySystemTime(&time);
+	auto sequence = (ULONG)InterlockedIncrement(&BackupSequence);
+	const WCHAR hex[] = L"0123456789ABCDEF";
+	auto p = target.Buffer + target.Length / sizeof(WCHAR);
+	*p++ = L'.';
+	for (int i = 15; i >= 0; i--)
+		*p++ = hex[(time.QuadPart >> (i * 4)) & 15];
+	for (int i = 7; i >= 0; i--)
+		*p++ = hex[(sequence >> (i * 4)) & 15];
+	target.Length += (1 + Digits) * sizeof(WCHAR);
+	RtlAppendUnicodeStringToString(&target, &suffixName);
+	return STATUS_SUCCESS;
+}
 
-				KdPrint(("Full Source Path Name: %wZ\n", &NameString));
+// Preserves the file being deleted. A hard link into the vault keeps the
+// contents without copying them, so then the delete may go ahead; otherwise
+// the contents are stored or copied and the delete is refused (deleteAllowed
+// is false).
+NTSTATUS BackupDeletedFile(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, bool& deleteAllowed) {
+	deleteAllowed = false;
 
+	PFLT_FILE_NAME_INFORMATION nameInfo;
+	auto status = FltGetFileNameInformation(Data, FLT_FILE_NAME_QUERY_DEFAULT | FLT_FILE_NAME_NORMALIZED, &nameInfo);
+	if (!NT_SUCCESS(status))
+		return status;
 
-				// Get DestinationFile DosName
-				auto destNameLength = (USHORT)dosName.MaximumLength + Data->Iopb->TargetFileObject->FileName.MaximumLength + 2 + 5; //We'll add .bkup at the end of the file extension
-				auto destNameBuffer = ExAllocatePoolWithTag(PagedPool, destNameLength, DRIVER_TAG);
-				if (destNameBuffer == nullptr) {
-					KdPrint(("Failed to allocate memory\n"));
-					return FLT_PREOP_COMPLETE;
-				}
-				UNICODE_STRING destNameString;
-				destNameString.Length = 0;
-				destNameString.MaximumLength = (USHORT)destNameLength;
-				destNameString.Buffer = (PWCH)destNameBuffer;
+	VolumeContext* context = nullptr;
+	PWCH targetBuffer = nullptr;
+	bool copying = false;
+	HANDLE hFile = nullptr;
+	PFILE_OBJECT file = nullptr;
+	do {
+		status = FltParseFileNameInformation(nameInfo);
+		if (!NT_SUCCESS(status))
+			break;
 
-				UNICODE_STRING binString = RTL_CONSTANT_STRING(L"\\$RECYCLE.BIN\\");
+		// backups stay on the file's own volume
+		status = FltGetInstanceContext(FltObjects->Instance, (PFLT_CONTEXT*)&context);
+		if (!NT_SUCCESS(status))
+			break;
 
-				RtlCopyUnicodeString(&destNameString, &symString);
-				//RtlCopyUnicodeString(&destNameString, &dosName);
-				RtlAppendUnicodeStringToString(&destNameString, &dosName);
-				RtlAppendUnicodeStringToString(&destNameString, &binString);
-				RtlAppendUnicodeStringToString(&destNameString, &nameInfo->FinalComponent);
+		// a separate attributes-only open: in pre-create the caller's file isn't open yet
+		OBJECT_ATTRIBUTES attr;
+		IO_STATUS_BLOCK ioStatus;
+		InitializeObjectAttributes(&attr, &nameInfo->Name, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+		status = FltCreateFileEx2(gFilterHandle, FltObjects->Instance, &hFile, &file, FILE_READ_ATTRIBUTES | SYNCHRONIZE,
+			&attr, &ioStatus, nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT, nullptr, 0, 0, nullptr);
+		if (!NT_SUCCESS(status))
+			break;
 
-				KdPrint(("Full Destination Path Name: %wZ\n", &destNameString));
+		BackupCandidate candidate;
+		status = QueryBackupCandidate(FltObjects->Instance, file, true, candidate);
+		if (!NT_SUCCESS(status))
+			break;
+		candidate.StoreReady = context->Store.IsReady();
+		candidate.PreferStore = ReadNoFence(&DedupAll) != 0;
+
+		auto method = ChooseBackupMethod(candidate);
+		if (method == BackupMethod::None) {
+			status = STATUS_SUCCESS;
+			break;
+		}
 
-				status = ntCopyFile(NameString, destNameString);
+		// a stored backup is named by its manifest
+		UNICODE_STRING targetName;
+		status = MakeBackupName(&context->BackupDir, &nameInfo->FinalComponent,
+			method == BackupMethod::Store ? L".manifest" : L"", targetName);
+		if (!NT_SUCCESS(status))
+			break;
+		targetBuffer = targetName.Buffer;
+
+		if (method == BackupMethod::Link) {
+			auto start = KeQueryInterruptTime();
+			status = LinkFile(FltObjects->Instance, file, &targetName);
+			if (NT_SUCCESS(status)) {
+				RecordBackup(context, status, start, 0, BackupMethod::Link);
+				KdPrint(("Linked %wZ to %wZ\n", &nameInfo->Name, &targetName));
+				InterlockedIncrement(&Linked);
+				deleteAllowed = true;
+				break;
+			}
+			KdPrint(("Linking %wZ failed (0x%08X), backing up its contents instead\n", &nameInfo->Name, status));
+			InterlockedIncrement(&LinkFailed);
+			candidate.LinkFailed = true;
+			method = ChooseBackupMethod(candidate);
+			if (method == BackupMethod::Store) {
+				ExFreePoolWithTag(targetBuffer, DRIVER_TAG);
+				targetBuffer = nullptr;
+				status = MakeBackupName(&context->BackupDir, &nameInfo->FinalComponent, L".manifest", targetName);
 				if (!NT_SUCCESS(status))
-				{
-					KdPrint(("ntCopyFile() failed:%x\n", status));
-				}
+					break;
+				targetBuffer = targetName.Buffer;
+			}
+		}
+
+		KdPrint(("Backing up %wZ to %wZ\n", &nameInfo->Name, &targetName));
+
+		// the copy is done by a backup worker unless the queue is full. This
+		// delete is refused, but another process may still delete, rename or
+		// overwrite the file before the worker gets to it; the queue holds the
+		// source open for that reason (see BackupQueue)
+		InstanceFile source{ FltObjects->Instance, nameInfo->Name };
+		InstanceFile target{ FltObjects->Instance, targetName };
+		copying = true;
+		status = Backups.Backup(source, target, (ULONG)method);
+	} while (false);
 
-				// Free the Pools we Allocated Earlier
-				ExFreePool(ObjectNameInformation);
-				ExFreePoolWithTag(NameBuffer, DRIVER_TAG);
-				ExFreePoolWithTag(destNameBuffer, DRIVER_TAG);
+	// copies and stores, failed or not, are recorded by BackupFile
+	if (context && !copying && !NT_SUCCESS(status))
+		InterlockedIncrement(&context->Failed);
+
+	if (file)
+		ObDereferenceObject(file);
+	if (hFile)
+		FltClose(hFile);
+	if (targetBuffer)
+		ExFreePoolWithTag(targetBuffer, DRIVER_TAG);
+	if (context)
+		FltReleaseContext(context);
+	FltReleaseFileNameInformation(nameInfo);
+	return status;
+}
 
+void DelProtectUnloadDriver(PDRIVER_OBJECT DriverObject) {
+	PsSetCreateProcessNotifyRoutineEx(OnProcessNotify, TRUE);
+	ExeNameSet::Free(ExeNames.Shutdown());
+	Backups.Shutdown();
+	CloseSha256();
+	UNICODE_STRING symLink = RTL_CONSTANT_STRING(L"\\??\\delprotect");
+	IoDeleteSymbolicLink(&symLink);
+	IoDeleteDevice(DriverObject->DeviceObject);
+}
 
 
-				//Data->IoStatus.Status = STATUS_ACCESS_DENIED;
-				Data->IoStatus.Status = STATUS_SUCCESS;
-				//KdPrint(("Prevented delete in IRP_MJ_CREATE\n"));
-				returnStatus = FLT_PREOP_COMPLETE;
+_Use_decl_annotations_
+FLT_PREOP_CALLBACK_STATUS DelProtectPreCreate(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PVOID*) {
+	UNREFERENCED_PARAMETER(FltObjects);
+
+	if (Data->RequestorMode == KernelMode)
+		return FLT_PREOP_SUCCESS_NO_CALLBACK;
+
+	auto& params = Data->Iopb->Parameters.Create;
+	auto returnStatus = FLT_PREOP_SUCCESS_NO_CALLBACK;
+
+	if (params.Options & FILE_DELETE_ON_CLOSE) {
+		// delete operation
+		KdPrint(("Delete on close: %wZ\n", &FltObjects->FileObject->FileName));
+
+		if (IsProcessProtected(Data)) {
+			bool deleteAllowed;
+			auto status = BackupDeletedFile(Data, FltObjects, deleteAllowed);
+			if (!NT_SUCCESS(status))
+			{
+				KdPrint(("Backup failed:%x\n", status));
 			}
-		}
-		ExFreePool(processName);
+			if (deleteAllowed)
+				return FLT_PREOP_SUCCESS_NO_CALLBACK;
 
+			//Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+			Data->IoStatus.Status = STATUS_SUCCESS;
+			//KdPrint(("Prevented delete in IRP_MJ_CREATE\n"));
+			returnStatus = FLT_PREOP_COMPLETE;
+		}
 	}
 	return returnStatus;
 }
@@ -1026,114 +1412,25 @@ FLT_PREOP_CALLBACK_STATUS DelProtectPreSetInformation(PFLT_CALLBACK_DATA Data, P
 	if (!info->DeleteFile)
 		return FLT_PREOP_SUCCESS_NO_CALLBACK;
 
-	// what process did this originate from?
-	auto process = PsGetThreadProcess(Data->Thread);
-	NT_ASSERT(process);
-
-	// open a handle
-	HANDLE hProcess;
-	auto status = ObOpenObjectByPointer(process, OBJ_KERNEL_HANDLE, nullptr, 0, nullptr, KernelMode, &hProcess);
-	if (!NT_SUCCESS(status))
-		return FLT_PREOP_SUCCESS_NO_CALLBACK;
-
 	auto returnStatus = FLT_PREOP_SUCCESS_NO_CALLBACK;
 
-	auto size = 512;	// some arbitrary size
-	auto processName = (UNICODE_STRING*)ExAllocatePool(PagedPool, size);
-	if (processName) {
-		RtlZeroMemory(processName, size);	// ensure string will be NULL-terminated
-		status = ZwQueryInformationProcess(hProcess, ProcessImageFileName, processName, size - sizeof(WCHAR), nullptr);
-
-		if (NT_SUCCESS(status) && processName->Length > 0) {
-			KdPrint(("Delete operation from %wZ\n"));
-
-			auto exeName = ::wcsrchr(processName->Buffer, L'\\');
-
-			if (exeName && FindExecutable(exeName + 1)) {	// skip backslash
-								
-				//UNICODE_STRING sFileName = (UNICODE_STRING)Data->Iopb->TargetFileObject->FileName;
-				//UNICODE_STRING sourceFileName = RTL_CONSTANT_STRING(L"\\??\\C:\\" sFileName);
-				//KdPrint(("Delete on close: %wZ\n", &sourceFileName));
-
-				PFLT_FILE_NAME_INFORMATION nameInfo = nullptr;
-
-				status = FltGetFileNameInformation(Data, FLT_FILE_NAME_QUERY_DEFAULT | FLT_FILE_NAME_NORMALIZED, &nameInfo);
-				if (!NT_SUCCESS(status)) 
-					return FLT_PREOP_COMPLETE;
-
-				status = FltParseFileNameInformation(nameInfo);
-				if (!NT_SUCCESS(status))
-					return FLT_PREOP_COMPLETE;
-
-				POBJECT_NAME_INFORMATION ObjectNameInformation = nullptr;
-				IoQueryFileDosDeviceName(Data->Iopb->TargetFileObject, &ObjectNameInformation);
-				KdPrint(("Dos Letter Name: %wZ\n", ObjectNameInformation->Name));
-
-				auto dosName = ObjectNameInformation->Name;
-				auto NameLength = (USHORT)dosName.MaximumLength + Data->Iopb->TargetFileObject->FileName.MaximumLength + 2;
-				auto NameBuffer = ExAllocatePoolWithTag(PagedPool, NameLength, DRIVER_TAG);
-				if (NameBuffer == nullptr) {
-					KdPrint(("Failed to allocate memory\n"));
-					return FLT_PREOP_COMPLETE;
-				}
-				UNICODE_STRING NameString;
-				NameString.Length = 0;
-				NameString.MaximumLength = (USHORT)NameLength;
-				NameString.Buffer = (PWCH)NameBuffer;
-
-				UNICODE_STRING symString = RTL_CONSTANT_STRING(L"\\??\\");
-				RtlCopyUnicodeString(&NameString, &symString);
-				//RtlAppendUnicodeStringToString(&NameString, &dosName);
-				RtlAppendUnicodeStringToString(&NameString, &ObjectNameInformation->Name);
-
-				KdPrint(("Full Source Path Name: %wZ\n", &NameString));
-
-
-				// Get DestinationFile DosName
-				auto destNameLength = (USHORT)dosName.MaximumLength + Data->Iopb->TargetFileObject->FileName.MaximumLength + 2 + 5; //We'll add .bkup at the end of the file extension
-				auto destNameBuffer = ExAllocatePoolWithTag(PagedPool, destNameLength, DRIVER_TAG);
-				if (destNameBuffer == nullptr) {
-					KdPrint(("Failed to allocate memory\n"));
-					return FLT_PREOP_COMPLETE;
-				}
-				UNICODE_STRING destNameString;
-				destNameString.Length = 0;
-				destNameString.MaximumLength = (USHORT)destNameLength;
-				destNameString.Buffer = (PWCH)destNameBuffer;
-
-				UNICODE_STRING binString = RTL_CONSTANT_STRING(L"\\??\\C:\\$RECYCLE.BIN\\");
-
-				//RtlCopyUnicodeString(&destNameString, &symString);
-				RtlCopyUnicodeString(&destNameString, &binString);
-				//RtlCopyUnicodeString(&destNameString, &dosName);
-				//RtlAppendUnicodeStringToString(&destNameString, &dosName);
-				//RtlAppendUnicodeStringToString(&destNameString, &binString);
-				RtlAppendUnicodeStringToString(&destNameString, &nameInfo->FinalComponent);
-
-				KdPrint(("Full Destination Recycle Path Name: %wZ\n", &destNameString));
-
-
-				status = ntCopyFile(NameString, destNameString);
-				if (!NT_SUCCESS(status))
-				{
-					KdPrint(("ntCopyFile() failed:%x\n", status));
-				}
-
-				// Free the Pools we Allocated Earlier
-				ExFreePool(ObjectNameInformation);
-				ExFreePoolWithTag(NameBuffer, DRIVER_TAG);
-				ExFreePoolWithTag(destNameBuffer, DRIVER_TAG);
-
-
-				// prevent delete
-				Data->IoStatus.Status = STATUS_SUCCESS;
-				returnStatus = FLT_PREOP_COMPLETE;
-				//KdPrint(("Prevented delete in IRP_MJ_SET_INFORMATION\n"));
-			}
+	// did this originate from a protected executable?
+	if (IsProcessProtected(Data)) {
+		bool deleteAllowed;
+		auto status = BackupDeletedFile(Data, FltObjects, deleteAllowed);
+		if (!NT_SUCCESS(status))
+		{
+			KdPrint(("Backup failed:%x\n", status));
 		}
-		ExFreePool(processName);
+		// the vault link keeps the contents
+		if (deleteAllowed)
+			return FLT_PREOP_SUCCESS_NO_CALLBACK;
+
+		// prevent delete
+		Data->IoStatus.Status = STATUS_SUCCESS;
+		returnStatus = FLT_PREOP_COMPLETE;
+		//KdPrint(("Prevented delete in IRP_MJ_SET_INFORMATION\n"));
 	}
-	ZwClose(hProcess);
 
 	return returnStatus;
 }
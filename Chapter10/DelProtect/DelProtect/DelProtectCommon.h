@@ -2,4 +2,83 @@
 
 #define IOCTL_DELPROTECT_ADD_EXE	CTL_CODE(0x8000, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_DELPROTECT_REMOVE_EXE CTL_CODE(0x8000, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
-#define IOCTL_DELPROTECT_CLEAR		CTL_CODE(0x8000, 0x802, METHOD_NEITHER, FILE_ANY_ACCESS)
\ No newline at end of file
+#define IOCTL_DELPROTECT_CLEAR		CTL_CODE(0x8000, 0x802, METHOD_NEITHER, FILE_ANY_ACCESS)
+// input: ULONG, the most executable names the driver accepts
+#define IOCTL_DELPROTECT_SET_EXE_LIMIT	CTL_CODE(0x8000, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_DELPROTECT_GET_BACKUP_STATS	CTL_CODE(0x8000, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+// input: ULONG, the size of each of the two copy buffers in bytes (64KB to 8MB)
+#define IOCTL_DELPROTECT_SET_COPY_BUFFER	CTL_CODE(0x8000, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+// output: an array of VolumeBackupStats, one per attached volume
+#define IOCTL_DELPROTECT_GET_VOLUMES		CTL_CODE(0x8000, 0x806, METHOD_BUFFERED, FILE_ANY_ACCESS)
+// input: ULONG, nonzero to keep every backup in the chunk store, even where a hard link would do
+#define IOCTL_DELPROTECT_SET_DEDUP			CTL_CODE(0x8000, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// IOCTL_DELPROTECT_GET_BACKUP_STATS output; times are in 100ns units
+struct BackupStats {
+	ULONG Queued;		// backups handed to the worker threads
+	ULONG Synchronous;	// copied on the deleting thread because the queue was full
+	ULONG Completed;
+	ULONG Failed;
+	ULONG Depth;		// backups waiting right now
+	ULONG MaxDepth;
+	ULONG QueueLimit;
+	ULONG Workers;
+	ULONGLONG TotalWaitTime;	// from queueing to the start of the copy
+	ULONGLONG TotalCopyTime;
+	ULONGLONG MaxCopyTime;
+	ULONGLONG BytesCopied;	// written, updated as backups progress, not only when they complete
+	// backup I/O is sent below DelProtect, so it skips the filters above it
+	ULONGLONG ReadIos;
+	ULONGLONG WriteIos;
+	ULONGLONG BytesRead;
+	// same-volume backups are hard links into the backup folder, no copy needed
+	ULONG Linked;
+	ULONG LinkFailed;	// fell back to copying
+	// backups kept in the chunk store write only the chunks it doesn't have;
+	// BytesRead / BytesCopied is the overall dedup ratio
+	ULONG Stored;
+	ULONG ChunksStored;
+	ULONG ChunksDeduped;	// found in the store already
+};
+
+// longest volume name returned, in characters including the NULL terminator
+const int MaxVolumeNameSize = 64;
+
+// IOCTL_DELPROTECT_GET_VOLUMES output element. Backups go to a directory on
+// the deleted file's own volume. Times are in 100ns units.
+struct VolumeBackupStats {
+	WCHAR VolumeName[MaxVolumeNameSize];	// e.g. \Device\HarddiskVolume3
+	ULONG BackupDirReady;	// zero if the backup directory couldn't be created
+	ULONG Linked;
+	ULONG Copied;
+	ULONG Stored;
+	ULONG Failed;
+	ULONG ChunksStored;
+	ULONG ChunksDeduped;
+	ULONG IndexEntries;		// chunks the store's index knows about
+	ULONGLONG BytesCopied;	// read from the files copied or stored
+	ULONGLONG BytesWritten;	// BytesCopied / BytesWritten is the dedup ratio
+	ULONGLONG TotalTime;	// link, store or copy time
+	ULONGLONG MaxTime;
+};
+
+// A backup kept in the chunk store is a manifest file in the volume's backup
+// directory: this header, the deleted file's full name (NameLength bytes,
+// no NULL), then ChunkCount entries. The file's contents are the listed
+// chunks in order; each chunk is the file chunks\<digest as lowercase hex>
+// under the backup directory.
+const ULONG ChunkManifestMagic = 'FMPD';	// "DPMF" on disk
+const ULONG ChunkManifestVersion = 1;
+
+struct ChunkManifestHeader {
+	ULONG Magic;
+	ULONG Version;
+	ULONGLONG FileSize;
+	ULONG ChunkCount;
+	ULONG NameLength;
+};
+
+struct ChunkManifestEntry {
+	UCHAR Digest[32];		// SHA-256 of the chunk
+	ULONG Size;
+};
@@ -0,0 +1,57 @@
+#include "ExeNameSet.h"
+#include "UnicodeFold.h"
+
+ExeNameSet* ExeNameSet::Create(ULONG count, ULONG nameChars, ULONG tag) {
+	ULONG slots = 8;
+	while (slots < count * 2)
+		slots *= 2;
+
+	auto size = sizeof(ExeNameSet) + count * sizeof(ExeNameEntry) + slots * sizeof(ULONG) + nameChars * sizeof(WCHAR);
+	auto set = (ExeNameSet*)ExAllocatePoolWithTag(PagedPool, size, tag);
+	if (!set)
+		return nullptr;
+
+	set->m_Count = 0;
+	set->m_Capacity = count;
+	set->m_SlotMask = slots - 1;
+	set->m_NameChars = 0;
+	set->m_Tag = tag;
+	set->m_Entries = (ExeNameEntry*)(set + 1);
+	set->m_Slots = (ULONG*)(set->m_Entries + count);
+	set->m_Names = (WCHAR*)(set->m_Slots + slots);
+	RtlZeroMemory(set->m_Slots, slots * sizeof(ULONG));
+	return set;
+}
+
+void ExeNameSet::Free(ExeNameSet* set) {
+	if (set)
+		ExFreePoolWithTag(set, set->m_Tag);
+}
+
+void ExeNameSet::Add(const kstring_view& name) {
+	NT_ASSERT(m_Count < m_Capacity);
+	NT_ASSERT(!Contains(name));
+
+	auto& entry = m_Entries[m_Count];
+	entry.Hash = FoldHash(name.Data(), name.Length());
+	entry.Offset = m_NameChars;
+	entry.Length = name.Length();
+	RtlCopyMemory(m_Names + m_NameChars, name.Data(), name.Length() * sizeof(WCHAR));
+	m_NameChars += name.Length();
+
+	auto slot = entry.Hash & m_SlotMask;
+	while (m_Slots[slot])
+		slot = (slot + 1) & m_SlotMask;
+	m_Slots[slot] = ++m_Count;
+}
+
+bool ExeNameSet::Contains(const kstring_view& name) const {
+	auto hash = FoldHash(name.Data(), name.Length());
+	for (auto slot = hash & m_SlotMask; m_Slots[slot]; slot = (slot + 1) & m_SlotMask) {
+		auto& entry = m_Entries[m_Slots[slot] - 1];
+		if (entry.Hash == hash && entry.Length == name.Length()
+			&& name.EqualsNoCase(kstring_view(m_Names + entry.Offset, entry.Length)))
+			return true;
+	}
+	return false;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <ntddk.h>
+#include "kstring_view.h"
+
+struct ExeNameEntry {
+	ULONG Hash;
+	ULONG Offset;	// into the name buffer, in characters
+	ULONG Length;
+};
+
+// An immutable, case-insensitive set of executable names, built once and
+// then only read, so it can be published as a snapshot and searched without
+// a lock. One allocation holds the entries, an open-addressed slot table
+// (at most half full) and the names themselves.
+class ExeNameSet final {
+public:
+	// room for count names totalling nameChars characters
+	static ExeNameSet* Create(ULONG count, ULONG nameChars, ULONG tag);
+	static void Free(ExeNameSet* set);
+
+	// only while building; the name must not be in the set yet
+	void Add(const kstring_view& name);
+
+	bool Contains(const kstring_view& name) const;
+
+	ULONG Count() const {
+		return m_Count;
+	}
+
+	// total characters of all names
+	ULONG NameChars() const {
+		return m_NameChars;
+	}
+
+	// the name as it was added, not folded
+	kstring_view Name(ULONG index) const {
+		NT_ASSERT(index < m_Count);
+		return kstring_view(m_Names + m_Entries[index].Offset, m_Entries[index].Length);
+	}
+
+private:
+	ULONG m_Count, m_Capacity;
+	ULONG m_SlotMask;
+	ULONG m_NameChars;
+	ULONG m_Tag;
+	ExeNameEntry* m_Entries;
+	ULONG* m_Slots;		// entry index + 1, zero when free
+	WCHAR* m_Names;		// as added
+};
@@ -0,0 +1,41 @@
+#include "ProcessCache.h"
+
+void ProcessCache::Init() {
+	RtlZeroMemory(m_Slots, sizeof(m_Slots));
+	m_Lock = 0;
+}
+
+void ProcessCache::Flush() {
+	auto irql = ExAcquireSpinLockExclusive(&m_Lock);
+	RtlZeroMemory(m_Slots, sizeof(m_Slots));
+	ExReleaseSpinLockExclusive(&m_Lock, irql);
+}
+
+bool ProcessCache::Lookup(HANDLE pid, ULONG generation, bool& isProtected) {
+	auto found = false;
+	auto irql = ExAcquireSpinLockShared(&m_Lock);
+	auto& entry = m_Slots[Slot(pid)];
+	if (entry.ProcessId == pid && entry.Generation == generation) {
+		isProtected = entry.Protected;
+		found = true;
+	}
+	ExReleaseSpinLockShared(&m_Lock, irql);
+	return found;
+}
+
+void ProcessCache::Insert(HANDLE pid, ULONG generation, bool isProtected) {
+	auto irql = ExAcquireSpinLockExclusive(&m_Lock);
+	auto& entry = m_Slots[Slot(pid)];
+	entry.ProcessId = pid;
+	entry.Generation = generation;
+	entry.Protected = isProtected;
+	ExReleaseSpinLockExclusive(&m_Lock, irql);
+}
+
+void ProcessCache::Remove(HANDLE pid) {
+	auto irql = ExAcquireSpinLockExclusive(&m_Lock);
+	auto& entry = m_Slots[Slot(pid)];
+	if (entry.ProcessId == pid)
+		entry.ProcessId = nullptr;
+	ExReleaseSpinLockExclusive(&m_Lock, irql);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <ntddk.h>
+
+struct ProcessVerdict {
+	HANDLE ProcessId;	// nullptr for an empty slot
+	ULONG Generation;
+	bool Protected;
+};
+
+// Remembers whether a process runs one of the protected executables, so a
+// delete only has to query the image name the first time the process (or
+// its creation) is seen. Direct-mapped on the process ID and stored inline:
+// nothing is allocated, and a colliding insert simply replaces the previous
+// occupant. Entries carry the executable list generation they were computed
+// under and only hit for that same generation. Entries must be removed when
+// their process exits, before the ID can be reused.
+// Lookup/Insert/Remove at IRQL <= DISPATCH_LEVEL.
+class ProcessCache final {
+public:
+	static const ULONG SlotCount = 1024;
+
+	void Init();
+	void Flush();
+
+	bool Lookup(HANDLE pid, ULONG generation, bool& isProtected);
+	void Insert(HANDLE pid, ULONG generation, bool isProtected);
+	void Remove(HANDLE pid);
+
+private:
+	static ULONG Slot(HANDLE pid) {
+		// process IDs are multiples of 4
+		return ((ULONG)(ULONG_PTR)pid >> 2) & (SlotCount - 1);
+	}
+
+private:
+	ProcessVerdict m_Slots[SlotCount];
+	EX_SPIN_LOCK m_Lock;
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <ntddk.h>
+
+// Publishes an immutable object to lock-free readers, RCU style.
+// Two slots alternate: the current one is pinned by readers through a
+// cache-aware rundown reference (per-CPU counters, so readers on different
+// cores don't share a cache line). A writer fills the other slot, flips the
+// current index and then waits only for readers still pinning the old slot
+// before handing the old object back to be freed.
+// Writers must be serialized by the caller. Acquire/Publish at PASSIVE_LEVEL.
+template<typename T>
+class SnapshotSlot {
+public:
+	NTSTATUS Init(ULONG tag) {
+		m_Current = 0;
+		m_Object[0] = m_Object[1] = nullptr;
+		m_Rundown[0] = m_Rundown[1] = nullptr;
+		for (auto& rundown : m_Rundown) {
+			rundown = ExAllocateCacheAwareRundownProtection(NonPagedPoolNx, tag);
+			if (!rundown) {
+				Shutdown();
+				return STATUS_INSUFFICIENT_RESOURCES;
+			}
+		}
+		return STATUS_SUCCESS;
+	}
+
+	// waits for all readers; returns the last published object for the caller to free
+	T* Shutdown() {
+		for (auto& rundown : m_Rundown) {
+			if (rundown) {
+				ExWaitForRundownProtectionReleaseCacheAware(rundown);
+				ExFreeCacheAwareRundownProtection(rundown);
+				rundown = nullptr;
+			}
+		}
+		auto object = m_Object[m_Current];
+		m_Object[0] = m_Object[1] = nullptr;
+		return object;
+	}
+
+	T* Acquire(LONG& slot) {
+		for (;;) {
+			slot = ReadAcquire(&m_Current);
+			if (!ExAcquireRundownProtectionCacheAware(m_Rundown[slot]))
+				continue;	// being retired, the writer has already flipped
+
+			// a reader that sampled the index long ago may have pinned a slot
+			// that was retired and reused since; only trust the current one
+			if (ReadAcquire(&m_Current) == slot)
+				return m_Object[slot];
+			ExReleaseRundownProtectionCacheAware(m_Rundown[slot]);
+		}
+	}
+
+	void Release(LONG slot) {
+		ExReleaseRundownProtectionCacheAware(m_Rundown[slot]);
+	}
+
+	// for writers, which are serialized: the published object can't be
+	// retired while they look at it
+	T* Current() const {
+		return m_Object[m_Current];
+	}
+
+	// swaps in next (may be null) and returns the previous object once
+	// no reader can observe it anymore
+	T* Publish(T* next) {
+		auto old = m_Current;
+		auto slot = old ^ 1;
+		m_Object[slot] = next;
+		InterlockedExchange(&m_Current, slot);
+
+		ExWaitForRundownProtectionReleaseCacheAware(m_Rundown[old]);
+		auto previous = m_Object[old];
+		m_Object[old] = nullptr;
+		ExRundownCompletedCacheAware(m_Rundown[old]);
+		ExReInitializeRundownProtectionCacheAware(m_Rundown[old]);
+		return previous;
+	}
+
+private:
+	T* m_Object[2];
+	PEX_RUNDOWN_REF_CACHE_AWARE m_Rundown[2];
+	LONG volatile m_Current;
+};
+
+// pins the current snapshot for the lifetime of the object
+template<typename T>
+struct SnapshotRef {
+	SnapshotRef(SnapshotSlot<T>& slot) : _slot(slot) {
+		_object = _slot.Acquire(_index);
+	}
+
+	~SnapshotRef() {
+		_slot.Release(_index);
+	}
+
+	const T* Get() const {
+		return _object;
+	}
+
+	const T* operator->() const {
+		return _object;
+	}
+
+	explicit operator bool() const {
+		return _object != nullptr;
+	}
+
+private:
+	SnapshotSlot<T>& _slot;
+	T* _object;
+	LONG _index;
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <ntddk.h>
+#include "kstring_view.h"
+
+// Case folding and hashing for the executable name set.
+// Folding is to upper case, the same way the object manager compares names.
+
+const ULONG FoldHashSeed = 2166136261;
+const ULONG FoldHashPrime = 16777619;
+
+inline WCHAR FoldChar(WCHAR ch) {
+	return kstring_view::FoldChar(ch);
+}
+
+inline ULONG FoldHashStep(ULONG hash, WCHAR ch) {
+	return (hash ^ FoldChar(ch)) * FoldHashPrime;
+}
+
+inline ULONG FoldHash(PCWCH str, ULONG len) {
+	auto hash = FoldHashSeed;
+	for (ULONG i = 0; i < len; i++)
+		hash = FoldHashStep(hash, str[i]);
+	return hash;
+}
+
+// folded must already be upper-cased
+inline bool EqualFolded(PCWCH folded, PCWCH str, ULONG len) {
+	return kstring_view::EqualNoCase(folded, str, len);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <fltKernel.h>
+#include "ChunkStore.h"
+
+// DelProtect's instance context: where backups of the volume's files go, on
+// the volume itself, and how those backups went. Set up when the instance
+// attaches; the counters are updated with interlocked operations.
+struct VolumeContext {
+	UNICODE_STRING VolumeName;	// e.g. \Device\HarddiskVolume3
+	UNICODE_STRING BackupDir;	// ends with a backslash
+	bool BackupDirReady;		// the directory exists or was created at attach time
+	ChunkStore Store;			// ready if its directory could be created; freed with the context
+
+	LONG volatile Linked;
+	LONG volatile Copied;
+	LONG volatile Stored;
+	LONG volatile Failed;
+	LONG volatile ChunksStored;
+	LONG volatile ChunksDeduped;
+	LONG64 volatile BytesCopied;	// read from files copied or stored
+	LONG64 volatile BytesWritten;	// by copies and the store
+	LONG64 volatile TotalTime;	// link, store or copy time, in 100ns units
+	LONG64 volatile MaxTime;
+
+	// BackupDir starts with the volume name, so both share this buffer
+	WCHAR Names[1];
+};
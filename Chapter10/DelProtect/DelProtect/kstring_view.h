@@ -0,0 +1,154 @@
+#pragma once
+
+#include <ntddk.h>
+#ifdef _M_X64
+#include <emmintrin.h>
+#endif
+
+// Non-owning view of a counted UTF-16 string, such as the UNICODE_STRING a
+// callback receives. Nothing is copied and no NULL terminator is needed, so
+// comparisons neither allocate nor rescan for the length.
+class kstring_view final {
+public:
+	static const ULONG npos = static_cast<ULONG>(-1);
+
+	kstring_view() : m_str(nullptr), m_Len(0) {
+	}
+
+	kstring_view(const wchar_t* str, ULONG len) : m_str(str), m_Len(len) {
+	}
+
+	kstring_view(PCUNICODE_STRING str) : m_str(str->Buffer), m_Len(str->Length / sizeof(WCHAR)) {
+	}
+
+	// string literals: the length is known at compile time
+	template<ULONG N>
+	kstring_view(const wchar_t(&str)[N]) : m_str(str), m_Len(N - 1) {
+	}
+
+	const wchar_t* Data() const {
+		return m_str;
+	}
+
+	ULONG Length() const {
+		return m_Len;
+	}
+
+	bool IsEmpty() const {
+		return m_Len == 0;
+	}
+
+	wchar_t operator[](ULONG index) const {
+		NT_ASSERT(index < m_Len);
+		return m_str[index];
+	}
+
+	kstring_view Substr(ULONG pos, ULONG count = npos) const {
+		if (pos > m_Len)
+			pos = m_Len;
+		if (count > m_Len - pos)
+			count = m_Len - pos;
+		return kstring_view(m_str + pos, count);
+	}
+
+	bool EqualsNoCase(const kstring_view& other) const {
+		return m_Len == other.m_Len && EqualNoCase(m_str, other.m_str, m_Len);
+	}
+
+	bool StartsWithNoCase(const kstring_view& prefix) const {
+		return m_Len >= prefix.m_Len && EqualNoCase(m_str, prefix.m_str, prefix.m_Len);
+	}
+
+	bool EndsWithNoCase(const kstring_view& suffix) const {
+		return m_Len >= suffix.m_Len && EqualNoCase(m_str + m_Len - suffix.m_Len, suffix.m_str, suffix.m_Len);
+	}
+
+	ULONG FindLast(wchar_t ch) const {
+		for (auto i = m_Len; i > 0; i--)
+			if (m_str[i - 1] == ch)
+				return i - 1;
+		return npos;
+	}
+
+	// the part after the last backslash (the whole string if there is none)
+	kstring_view FileName() const {
+		auto pos = FindLast(L'\\');
+		return pos == npos ? *this : Substr(pos + 1);
+	}
+
+	// yields the backslash-separated components one at a time;
+	// start with pos = 0, empty components are skipped
+	bool NextComponent(ULONG& pos, kstring_view& component) const {
+		while (pos < m_Len && m_str[pos] == L'\\')
+			pos++;
+		if (pos >= m_Len)
+			return false;
+
+		auto start = pos;
+		while (pos < m_Len && m_str[pos] != L'\\')
+			pos++;
+		component = kstring_view(m_str + start, pos - start);
+		return true;
+	}
+
+	// the result points at the same characters
+	UNICODE_STRING ToUnicodeString() const {
+		UNICODE_STRING str;
+		str.Buffer = const_cast<PWCH>(m_str);
+		str.Length = str.MaximumLength = static_cast<USHORT>(m_Len * sizeof(WCHAR));
+		return str;
+	}
+
+	static wchar_t FoldChar(wchar_t ch) {
+		if (ch < 0x80)
+			return (ch >= L'a' && ch <= L'z') ? ch - (L'a' - L'A') : ch;
+		return RtlUpcaseUnicodeChar(ch);
+	}
+
+	// case-insensitive equality of len characters. On x64 ASCII runs are
+	// folded and compared 8 characters at a time with SSE2 (always present
+	// there and usable without saving extended state); any block holding
+	// a non-ASCII character drops to the scalar path.
+	static bool EqualNoCase(const wchar_t* s1, const wchar_t* s2, ULONG len) {
+		ULONG i = 0;
+#ifdef _M_X64
+		const auto nonAscii = _mm_set1_epi16(static_cast<short>(0xff80));
+		const auto beforeLower = _mm_set1_epi16(L'a' - 1);
+		const auto afterLower = _mm_set1_epi16(L'z' + 1);
+		const auto caseBit = _mm_set1_epi16(L'a' - L'A');
+		for (; i + 8 <= len; i += 8) {
+			auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s1 + i));
+			auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s2 + i));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(a, b)) == 0xffff)
+				continue;
+
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(_mm_or_si128(a, b), nonAscii), _mm_setzero_si128())) != 0xffff) {
+				if (!EqualNoCaseScalar(s1 + i, s2 + i, 8))
+					return false;
+				continue;
+			}
+
+			// ASCII only: clear the case bit of a..z
+			auto lowerA = _mm_and_si128(_mm_cmpgt_epi16(a, beforeLower), _mm_cmplt_epi16(a, afterLower));
+			auto lowerB = _mm_and_si128(_mm_cmpgt_epi16(b, beforeLower), _mm_cmplt_epi16(b, afterLower));
+			a = _mm_sub_epi16(a, _mm_and_si128(lowerA, caseBit));
+			b = _mm_sub_epi16(b, _mm_and_si128(lowerB, caseBit));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(a, b)) != 0xffff)
+				return false;
+		}
+#endif
+		return EqualNoCaseScalar(s1 + i, s2 + i, len - i);
+	}
+
+private:
+	static bool EqualNoCaseScalar(const wchar_t* s1, const wchar_t* s2, ULONG len) {
+		for (ULONG i = 0; i < len; i++)
+			if (s1[i] != s2[i] && FoldChar(s1[i]) != FoldChar(s2[i]))
+				return false;
+		return true;
+	}
+
+private:
+	const wchar_t* m_str;
+	ULONG m_Len;
+};
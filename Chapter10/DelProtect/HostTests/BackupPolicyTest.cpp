@@ -0,0 +1,99 @@
+// Checks ChooseBackupMethod against a simulated file system: each case
+// describes the volumes and the file, and the candidate is gathered from
+// them the way QueryBackupCandidate gathers it from the real one.
+
+#include <stdio.h>
+#include "BackupPolicy.h"
+
+namespace {
+	struct SimVolume {
+		bool SupportsLinks;		// FILE_SUPPORTS_HARD_LINKS
+		bool StoreReady;		// has a chunk store in its vault
+	};
+
+	struct SimFile {
+		const SimVolume* Volume;
+		bool Directory;
+		unsigned LinkCount;
+	};
+
+	const SimVolume Ntfs{ true, true };
+	const SimVolume NtfsNoStore{ true, false };
+	const SimVolume Fat{ false, true };
+	const SimVolume FatNoStore{ false, false };
+
+	BackupCandidate Gather(const SimFile& file, const SimVolume* vault, bool linkFailed, bool preferStore) {
+		BackupCandidate candidate{};
+		candidate.SameVolume = file.Volume == vault;
+		candidate.VolumeSupportsLinks = candidate.SameVolume && file.Volume->SupportsLinks;
+		candidate.Directory = file.Directory;
+		candidate.LinkCount = file.LinkCount;
+		candidate.LinkFailed = linkFailed;
+		candidate.StoreReady = vault->StoreReady;
+		candidate.PreferStore = preferStore;
+		return candidate;
+	}
+
+	const char* Name(BackupMethod method) {
+		switch (method) {
+			case BackupMethod::None: return "None";
+			case BackupMethod::Link: return "Link";
+			case BackupMethod::Store: return "Store";
+			case BackupMethod::Copy: return "Copy";
+		}
+		return "?";
+	}
+
+	int Failures;
+
+	void Check(const char* test, const SimFile& file, const SimVolume* vault, bool linkFailed, bool preferStore,
+		BackupMethod expected) {
+		auto method = ChooseBackupMethod(Gather(file, vault, linkFailed, preferStore));
+		if (method != expected) {
+			printf("FAIL %s: %s, expected %s\n", test, Name(method), Name(expected));
+			Failures++;
+		}
+	}
+}
+
+int main() {
+	// directories are never backed up, whatever else holds
+	Check("directory", { &Ntfs, true, 1 }, &Ntfs, false, false, BackupMethod::None);
+	Check("directory, prefer store", { &Ntfs, true, 1 }, &Ntfs, false, true, BackupMethod::None);
+	Check("directory, cross-volume", { &Fat, true, 1 }, &Ntfs, false, false, BackupMethod::None);
+
+	// same volume with link support: a link
+	Check("link", { &Ntfs, false, 1 }, &Ntfs, false, false, BackupMethod::Link);
+	Check("link, no store", { &NtfsNoStore, false, 1 }, &NtfsNoStore, false, false, BackupMethod::Link);
+	Check("link, already linked", { &Ntfs, false, 5 }, &Ntfs, false, false, BackupMethod::Link);
+
+	// another volume: no link, and the store only takes files on its own volume
+	Check("cross-volume", { &Fat, false, 1 }, &Ntfs, false, false, BackupMethod::Copy);
+	Check("cross-volume, prefer store", { &Fat, false, 1 }, &Ntfs, false, true, BackupMethod::Copy);
+	Check("cross-volume, both NTFS", { &NtfsNoStore, false, 1 }, &Ntfs, false, false, BackupMethod::Copy);
+
+	// no hard link support
+	Check("no links", { &Fat, false, 1 }, &Fat, false, false, BackupMethod::Store);
+	Check("no links, no store", { &FatNoStore, false, 1 }, &FatNoStore, false, false, BackupMethod::Copy);
+
+	// at the link limit
+	Check("link limit", { &Ntfs, false, MaxFileLinks }, &Ntfs, false, false, BackupMethod::Store);
+	Check("link limit, no store", { &NtfsNoStore, false, MaxFileLinks }, &NtfsNoStore, false, false, BackupMethod::Copy);
+	Check("below link limit", { &Ntfs, false, MaxFileLinks - 1 }, &Ntfs, false, false, BackupMethod::Link);
+
+	// a link was tried and failed
+	Check("link failed", { &Ntfs, false, 1 }, &Ntfs, true, false, BackupMethod::Store);
+	Check("link failed, no store", { &NtfsNoStore, false, 1 }, &NtfsNoStore, true, false, BackupMethod::Copy);
+
+	// asked to store everything: only where there is a store
+	Check("prefer store", { &Ntfs, false, 1 }, &Ntfs, false, true, BackupMethod::Store);
+	Check("prefer store, no store", { &NtfsNoStore, false, 1 }, &NtfsNoStore, false, true, BackupMethod::Link);
+	Check("prefer store, link failed", { &Ntfs, false, 1 }, &Ntfs, true, true, BackupMethod::Store);
+
+	if (Failures) {
+		printf("%d case(s) failed\n", Failures);
+		return 1;
+	}
+	printf("all cases passed\n");
+	return 0;
+}
@@ -0,0 +1,301 @@
+// Checks the chunker and the chunk index, then measures them: a synthetic
+// corpus with duplicated, shifted and edited copies is chunked and hashed
+// the way ChunkStore::Store does it, and the throughput (GB/s) and dedup
+// ratio are reported.
+//
+// usage: ChunkerBench [corpus MB]	(default 64; 0 runs only the checks)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "Chunker.h"
+#include "ChunkIndex.h"
+
+namespace {
+	// as in ChunkStore.h
+	const unsigned MinChunkSize = 16 * 1024;
+	const unsigned AverageChunkBits = 16;		// 64KB
+	const unsigned MaxChunkSize = 256 * 1024;
+	const unsigned IndexSlots = 16384;
+
+	int Failures;
+
+	void Expect(bool condition, const char* what) {
+		if (!condition) {
+			printf("FAIL %s\n", what);
+			Failures++;
+		}
+	}
+
+	// SHA-256, as the driver digests chunks with BCrypt
+	class Sha256 final {
+	public:
+		static void Hash(const unsigned char* data, size_t length, ChunkDigest& digest) {
+			unsigned h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+			size_t i = 0;
+			for (; i + 64 <= length; i += 64)
+				Block(h, data + i);
+
+			unsigned char tail[128] = {};
+			auto rest = length - i;
+			memcpy(tail, data + i, rest);
+			tail[rest] = 0x80;
+			size_t tailLength = rest + 9 <= 64 ? 64 : 128;
+			auto bits = (unsigned long long)length * 8;
+			for (int b = 0; b < 8; b++)
+				tail[tailLength - 1 - b] = (unsigned char)(bits >> (b * 8));
+			for (size_t t = 0; t < tailLength; t += 64)
+				Block(h, tail + t);
+
+			for (int w = 0; w < 8; w++) {
+				for (int b = 0; b < 4; b++)
+					digest.Bytes[w * 4 + b] = (unsigned char)(h[w] >> (24 - b * 8));
+			}
+		}
+
+	private:
+		static unsigned Rotate(unsigned x, int n) {
+			return (x >> n) | (x << (32 - n));
+		}
+
+		static void Block(unsigned h[8], const unsigned char* p) {
+			static const unsigned K[64] = {
+				0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+				0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+				0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+				0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+				0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+				0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+				0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+				0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+			};
+			unsigned w[64];
+			for (int i = 0; i < 16; i++)
+				w[i] = (unsigned)p[i * 4] << 24 | (unsigned)p[i * 4 + 1] << 16 | (unsigned)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+			for (int i = 16; i < 64; i++) {
+				auto s0 = Rotate(w[i - 15], 7) ^ Rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+				auto s1 = Rotate(w[i - 2], 17) ^ Rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+				w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+			}
+
+			auto a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+			for (int i = 0; i < 64; i++) {
+				auto t1 = hh + (Rotate(e, 6) ^ Rotate(e, 11) ^ Rotate(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+				auto t2 = (Rotate(a, 2) ^ Rotate(a, 13) ^ Rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+				hh = g; g = f; f = e; e = d + t1;
+				d = c; c = b; b = a; a = t1 + t2;
+			}
+			h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+			h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+		}
+	};
+
+	unsigned long long NextRandom(unsigned long long& state) {
+		auto z = (state += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+
+	std::vector<unsigned char> RandomBytes(size_t size, unsigned long long seed) {
+		std::vector<unsigned char> data(size);
+		for (size_t i = 0; i < size; i += 8) {
+			auto value = NextRandom(seed);
+			memcpy(&data[i], &value, size - i < 8 ? size - i : 8);
+		}
+		return data;
+	}
+
+	// chunk lengths of data, fed in blocks of blockSize as BlockReader hands them out
+	std::vector<unsigned> ChunkLengths(const std::vector<unsigned char>& data, unsigned blockSize) {
+		std::vector<unsigned> lengths;
+		Chunker chunker;
+		chunker.Init(MinChunkSize, AverageChunkBits, MaxChunkSize);
+		unsigned current = 0;
+		for (size_t offset = 0; offset < data.size(); offset += blockSize) {
+			auto length = (unsigned)(data.size() - offset < blockSize ? data.size() - offset : blockSize);
+			auto block = data.data() + offset;
+			while (length > 0) {
+				bool boundary;
+				auto used = chunker.Next(block, length, boundary);
+				current += used;
+				block += used;
+				length -= used;
+				if (boundary) {
+					lengths.push_back(current);
+					current = 0;
+				}
+			}
+		}
+		if (current > 0)
+			lengths.push_back(current);
+		return lengths;
+	}
+
+	void CheckChunker() {
+		auto data = RandomBytes(8 * 1024 * 1024, 1);
+		auto lengths = ChunkLengths(data, 1024 * 1024);
+		size_t total = 0;
+		auto bounded = true;
+		for (size_t i = 0; i < lengths.size(); i++) {
+			total += lengths[i];
+			auto last = i + 1 == lengths.size();
+			if (lengths[i] > MaxChunkSize || (!last && lengths[i] < MinChunkSize) || lengths[i] == 0)
+				bounded = false;
+		}
+		Expect(total == data.size(), "chunks cover the whole input");
+		Expect(bounded, "chunk sizes stay within the minimum and maximum");
+
+		// the boundaries depend on the content only, not on how it is fed in
+		Expect(ChunkLengths(data, 4096) == lengths, "the same chunks whatever the block size");
+
+		// data without boundaries is cut at the maximum
+		std::vector<unsigned char> zeros(1024 * 1024);
+		auto zeroLengths = ChunkLengths(zeros, 64 * 1024);
+		auto allMax = true;
+		for (auto length : zeroLengths)
+			allMax = allMax && length == MaxChunkSize;
+		Expect(allMax && zeroLengths.size() == zeros.size() / MaxChunkSize, "constant data is cut at the maximum size");
+
+		// a short input is a single chunk
+		std::vector<unsigned char> small(MinChunkSize / 2, 7);
+		auto smallLengths = ChunkLengths(small, 4096);
+		Expect(smallLengths.size() == 1 && smallLengths[0] == small.size(), "an input below the minimum is one chunk");
+	}
+
+	ChunkDigest MakeDigest(unsigned n) {
+		ChunkDigest digest;
+		Sha256::Hash((const unsigned char*)&n, sizeof(n), digest);
+		return digest;
+	}
+
+	void CheckIndex() {
+		// the SHA-256 of "abc"
+		ChunkDigest abc;
+		Sha256::Hash((const unsigned char*)"abc", 3, abc);
+		const unsigned char expected[4] = { 0xba, 0x78, 0x16, 0xbf };
+		Expect(memcmp(abc.Bytes, expected, sizeof(expected)) == 0, "SHA-256 test vector");
+
+		const unsigned slots = 1024;
+		std::vector<unsigned char> memory(ChunkIndex::MemorySize(slots));
+		ChunkIndex index;
+		index.Init(memory.data(), slots);
+
+		unsigned inserted = 0;
+		while (index.Insert(MakeDigest(inserted)))
+			inserted++;
+		Expect(inserted == slots / 4 * 3, "inserts stop at three quarters full");
+		Expect(index.Count() == inserted, "the count matches the inserts");
+
+		auto allFound = true;
+		for (unsigned i = 0; i < inserted; i++)
+			allFound = allFound && index.Contains(MakeDigest(i));
+		Expect(allFound, "every inserted digest is found");
+
+		auto noneFound = true;
+		for (unsigned i = inserted; i < inserted + 10000; i++)
+			noneFound = noneFound && !index.Contains(MakeDigest(i));
+		Expect(noneFound, "digests never inserted are not found");
+
+		index.Init(memory.data(), slots);
+		Expect(index.Insert(MakeDigest(1)) && index.Insert(MakeDigest(1)) && index.Count() == 1,
+			"inserting a digest twice keeps one entry");
+	}
+
+	// a base of unique content, then copies of parts of it: exact duplicates,
+	// copies shifted by an insertion near the start, and copies edited in the middle
+	std::vector<std::vector<unsigned char>> MakeCorpus(size_t totalSize) {
+		std::vector<std::vector<unsigned char>> files;
+		const size_t fileSize = 4 * 1024 * 1024;
+		auto baseCount = totalSize / fileSize / 4;
+		if (baseCount == 0)
+			baseCount = 1;
+		unsigned long long seed = 42;
+
+		for (size_t i = 0; i < baseCount; i++)
+			files.push_back(RandomBytes(fileSize, NextRandom(seed)));
+
+		for (size_t i = 0; i < baseCount; i++) {
+			// duplicated
+			files.push_back(files[i]);
+
+			// shifted: a few bytes inserted near the start
+			auto shifted = files[i];
+			auto insert = RandomBytes(1 + NextRandom(seed) % 100, NextRandom(seed));
+			shifted.insert(shifted.begin() + 1000, insert.begin(), insert.end());
+			files.push_back(std::move(shifted));
+
+			// edited: a run of bytes overwritten in the middle
+			auto edited = files[i];
+			auto patch = RandomBytes(4096, NextRandom(seed));
+			memcpy(&edited[edited.size() / 2], patch.data(), patch.size());
+			files.push_back(std::move(edited));
+		}
+		return files;
+	}
+
+	double Seconds(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void Bench(size_t corpusSize) {
+		auto files = MakeCorpus(corpusSize);
+		size_t total = 0;
+		for (auto& file : files)
+			total += file.size();
+		printf("corpus: %zu files, %.1f MB\n", files.size(), total / 1e6);
+
+		// chunking alone
+		size_t chunks = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (auto& file : files)
+			chunks += ChunkLengths(file, 1024 * 1024).size();
+		auto chunkTime = Seconds(start);
+
+		// chunking, hashing and the index, as ChunkStore::Store does
+		std::vector<unsigned char> memory(ChunkIndex::MemorySize(IndexSlots));
+		ChunkIndex index;
+		index.Init(memory.data(), IndexSlots);
+		size_t unique = 0;
+		unsigned full = 0;
+		start = std::chrono::steady_clock::now();
+		for (auto& file : files) {
+			size_t offset = 0;
+			for (auto length : ChunkLengths(file, 1024 * 1024)) {
+				ChunkDigest digest;
+				Sha256::Hash(file.data() + offset, length, digest);
+				if (!index.Contains(digest)) {
+					unique += length;
+					if (!index.Insert(digest))
+						full++;
+				}
+				offset += length;
+			}
+		}
+		auto storeTime = Seconds(start);
+
+		printf("chunks: %zu, average %.1f KB\n", chunks, total / 1024.0 / chunks);
+		printf("chunk:        %.2f GB/s\n", total / chunkTime / 1e9);
+		printf("chunk + hash: %.2f GB/s\n", total / storeTime / 1e9);
+		printf("unique: %.1f MB, dedup ratio %.2f\n", unique / 1e6, (double)total / unique);
+		if (full)
+			printf("index full: %u digests not remembered\n", full);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	CheckChunker();
+	CheckIndex();
+	if (Failures) {
+		printf("%d check(s) failed\n", Failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+
+	auto megabytes = argc > 1 ? strtoul(argv[1], nullptr, 10) : 64;
+	if (megabytes > 0)
+		Bench((size_t)megabytes * 1024 * 1024);
+	return 0;
+}
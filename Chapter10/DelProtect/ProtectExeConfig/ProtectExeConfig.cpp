@@ -11,7 +11,7 @@ int Error(const char* text) {
 
 int PrintUsage() {
 	printf("Usage: ProtectExeConfig <option> [exename]\n");
-	printf("\tOption: add, remove or clear\n");
+	printf("\tOption: add, remove, clear, stats, volumes, limit <count>, buffer <KB> or dedup on|off\n");
 	return 0;
 }
 
@@ -45,6 +45,75 @@ int wmain(int argc, const wchar_t* argv[]) {
 	else if (::_wcsicmp(argv[1], L"clear") == 0) {
 		success = ::DeviceIoControl(hDevice, IOCTL_DELPROTECT_CLEAR, nullptr, 0, nullptr, 0, &returned, nullptr);
 	}
+	else if (::_wcsicmp(argv[1], L"limit") == 0) {
+		if (argc < 3)
+			return PrintUsage();
+
+		ULONG limit = ::wcstoul(argv[2], nullptr, 0);
+		success = ::DeviceIoControl(hDevice, IOCTL_DELPROTECT_SET_EXE_LIMIT, &limit, sizeof(limit), nullptr, 0, &returned, nullptr);
+	}
+	else if (::_wcsicmp(argv[1], L"buffer") == 0) {
+		if (argc < 3)
+			return PrintUsage();
+
+		ULONG size = ::wcstoul(argv[2], nullptr, 0) * 1024;
+		success = ::DeviceIoControl(hDevice, IOCTL_DELPROTECT_SET_COPY_BUFFER, &size, sizeof(size), nullptr, 0, &returned, nullptr);
+	}
+	else if (::_wcsicmp(argv[1], L"dedup") == 0) {
+		if (argc < 3)
+			return PrintUsage();
+
+		ULONG dedup = ::_wcsicmp(argv[2], L"on") == 0;
+		success = ::DeviceIoControl(hDevice, IOCTL_DELPROTECT_SET_DEDUP, &dedup, sizeof(dedup), nullptr, 0, &returned, nullptr);
+	}
+	else if (::_wcsicmp(argv[1], L"stats") == 0) {
+		BackupStats stats;
+		success = ::DeviceIoControl(hDevice, IOCTL_DELPROTECT_GET_BACKUP_STATS, nullptr, 0, &stats, sizeof(stats), &returned, nullptr);
+		if (success) {
+			auto started = stats.Completed + stats.Failed;
+			printf("Backups linked: %u (%u links failed)\n", stats.Linked, stats.LinkFailed);
+			printf("Backups stored: %u chunks stored: %u deduplicated: %u\n",
+				stats.Stored, stats.ChunksStored, stats.ChunksDeduped);
+			printf("Backups queued: %u synchronous: %u completed: %u failed: %u\n",
+				stats.Queued, stats.Synchronous, stats.Completed, stats.Failed);
+			printf("Queue depth: %u max: %u limit: %u workers: %u\n",
+				stats.Depth, stats.MaxDepth, stats.QueueLimit, stats.Workers);
+			// times are in 100ns units
+			printf("Average wait: %.2f msec average copy: %.2f msec max copy: %.2f msec\n",
+				stats.Queued ? stats.TotalWaitTime / 10000.0 / stats.Queued : 0.0,
+				started ? stats.TotalCopyTime / 10000.0 / started : 0.0,
+				stats.MaxCopyTime / 10000.0);
+			printf("Bytes copied: %llu (%.1f MB/sec)\n", stats.BytesCopied,
+				stats.TotalCopyTime ? stats.BytesCopied / (1024.0 * 1024.0) / (stats.TotalCopyTime / 10000000.0) : 0.0);
+			printf("I/O below the filter: %llu reads (%llu bytes) %llu writes (%llu bytes)\n",
+				stats.ReadIos, stats.BytesRead, stats.WriteIos, stats.BytesCopied);
+			printf("Dedup ratio: %.2f\n", stats.BytesCopied ? (double)stats.BytesRead / stats.BytesCopied : 0.0);
+		}
+	}
+	else if (::_wcsicmp(argv[1], L"volumes") == 0) {
+		VolumeBackupStats volumes[64];
+		success = ::DeviceIoControl(hDevice, IOCTL_DELPROTECT_GET_VOLUMES, nullptr, 0, volumes, sizeof(volumes), &returned, nullptr);
+		// ERROR_MORE_DATA still returns the volumes that fit
+		if (!success && ::GetLastError() == ERROR_MORE_DATA)
+			success = TRUE;
+		if (success) {
+			for (DWORD i = 0; i < returned / sizeof(VolumeBackupStats); i++) {
+				auto& volume = volumes[i];
+				auto count = volume.Linked + volume.Copied + volume.Stored;
+				printf("%ws%s\n", volume.VolumeName, volume.BackupDirReady ? "" : " (no backup directory)");
+				printf("\tlinked: %u copied: %u stored: %u failed: %u\n",
+					volume.Linked, volume.Copied, volume.Stored, volume.Failed);
+				printf("\tchunks stored: %u deduplicated: %u indexed: %u\n",
+					volume.ChunksStored, volume.ChunksDeduped, volume.IndexEntries);
+				printf("\tbytes backed up: %llu written: %llu dedup ratio: %.2f\n",
+					volume.BytesCopied, volume.BytesWritten,
+					volume.BytesWritten ? (double)volume.BytesCopied / volume.BytesWritten : 0.0);
+				// times are in 100ns units
+				printf("\taverage time: %.2f msec max: %.2f msec\n",
+					count ? volume.TotalTime / 10000.0 / count : 0.0, volume.MaxTime / 10000.0);
+			}
+		}
+	}
 	else {
 		badOption = true;
 		printf("Unknown option.\n");
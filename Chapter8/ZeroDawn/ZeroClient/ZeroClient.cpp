@@ -14,11 +14,58 @@ int Error(const char* msg) {
 }
 
 int PrintUsage() {
-	printf("Usage: DelProtectConfig3 <option> [directory]\n");
-	printf("\tOption: add, remove or clear\n");
+	printf("Usage: DelProtectConfig3 <option> [directory | bytes | file]\n");
+	printf("\tOption: add, remove, clear, limit, load or stats\n");
 	return 0;
 }
 
+// packs the directories listed in file (one per line) into a single
+// IOCTL_DELPROTECT_LOAD_DIRS buffer; empty lines and lines starting with # are skipped
+BYTE* BuildDirList(const wchar_t* file, DWORD& size) {
+	FILE* fp;
+	if (::_wfopen_s(&fp, file, L"rt, ccs=UTF-8") != 0) {
+		printf("Failed to open %ws\n", file);
+		return nullptr;
+	}
+
+	DWORD capacity = 1 << 16;
+	auto buffer = (BYTE*)::malloc(capacity);
+	size = sizeof(DirListHeader);
+	ULONG count = 0;
+	wchar_t line[MaxDirNameLength + 2];
+	while (buffer && ::fgetws(line, _countof(line), fp)) {
+		auto len = ::wcslen(line);
+		while (len > 0 && (line[len - 1] == L'\n' || line[len - 1] == L'\r' || line[len - 1] == L' '))
+			line[--len] = L'\0';
+		if (len == 0 || line[0] == L'#')
+			continue;
+
+		auto bytes = (USHORT)(len * sizeof(WCHAR));
+		if (size + sizeof(USHORT) + bytes > capacity) {
+			capacity *= 2;
+			auto newBuffer = (BYTE*)::realloc(buffer, capacity);
+			if (!newBuffer) {
+				::free(buffer);
+				buffer = nullptr;
+				break;
+			}
+			buffer = newBuffer;
+		}
+		auto entry = (DirListEntry*)(buffer + size);
+		entry->Length = bytes;
+		::memcpy(entry->Name, line, bytes);
+		size += sizeof(USHORT) + bytes;
+		count++;
+	}
+	::fclose(fp);
+
+	if (buffer) {
+		((DirListHeader*)buffer)->Count = count;
+		printf("Loading %u directories (%u bytes)\n", count, size);
+	}
+	return buffer;
+}
+
 int wmain(int argc, const wchar_t* argv[]) {
 	if (argc < 2) {
 		return PrintUsage();
@@ -52,6 +99,33 @@ int wmain(int argc, const wchar_t* argv[]) {
 	else if (::_wcsicmp(argv[1], L"clear") == 0) {
 		success = ::DeviceIoControl(hDevice, IOCTL_DELPROTECT_CLEAR, nullptr, 0, nullptr, 0, &returned, nullptr);
 	}
+	else if (::_wcsicmp(argv[1], L"limit") == 0) {
+		if (argc < 3)
+			return PrintUsage();
+
+		ULONG limit = ::wcstoul(argv[2], nullptr, 0);
+		success = ::DeviceIoControl(hDevice, IOCTL_DELPROTECT_SET_LIMIT, &limit, sizeof(limit), nullptr, 0, &returned, nullptr);
+	}
+	else if (::_wcsicmp(argv[1], L"load") == 0) {
+		if (argc < 3)
+			return PrintUsage();
+
+		DWORD size;
+		auto buffer = BuildDirList(argv[2], size);
+		if (!buffer)
+			return 1;
+
+		success = ::DeviceIoControl(hDevice, IOCTL_DELPROTECT_LOAD_DIRS, buffer, size, nullptr, 0, &returned, nullptr);
+		::free(buffer);
+	}
+	else if (::_wcsicmp(argv[1], L"stats") == 0) {
+		VerdictCacheStats stats;
+		success = ::DeviceIoControl(hDevice, IOCTL_DELPROTECT_GET_STATS, nullptr, 0, &stats, sizeof(stats), &returned, nullptr);
+		if (success) {
+			printf("Verdict cache: %u/%u entries\n", stats.Entries, stats.Capacity);
+			printf("Hits: %u Misses: %u Evictions: %u\n", stats.Hits, stats.Misses, stats.Evictions);
+		}
+	}
 	else {
 		badOption = true;
 		printf("Unknown option.\n");
@@ -0,0 +1,133 @@
+#include "pch.h"
+#include "DirectoryTable.h"
+#include "UnicodeFold.h"
+
+namespace {
+	// directories are stored with a trailing backslash; lookups may omit it
+	UNICODE_STRING TrimSeparator(PCUNICODE_STRING name) {
+		UNICODE_STRING trimmed = *name;
+		if (trimmed.Length >= sizeof(WCHAR) && trimmed.Buffer[trimmed.Length / sizeof(WCHAR) - 1] == L'\\')
+			trimmed.Length -= sizeof(WCHAR);
+		return trimmed;
+	}
+
+	ULONG HashName(PCUNICODE_STRING name) {
+		return FoldHash(name->Buffer, name->Length / sizeof(WCHAR));
+	}
+}
+
+void DirectoryTable::Init(POOL_TYPE pool, ULONG tag) {
+	m_Buckets = nullptr;
+	m_BucketCount = 0;
+	m_Count = 0;
+	m_Bytes = 0;
+	m_Pool = pool;
+	m_Tag = tag;
+}
+
+void DirectoryTable::Clear() {
+	for (ULONG i = 0; i < m_BucketCount; i++) {
+		auto entry = m_Buckets[i];
+		while (entry) {
+			auto next = entry->Next;
+			FreeEntry(entry);
+			entry = next;
+		}
+	}
+	if (m_Buckets)
+		ExFreePoolWithTag(m_Buckets, m_Tag);
+
+	m_Buckets = nullptr;
+	m_BucketCount = 0;
+	m_Count = 0;
+	m_Bytes = 0;
+}
+
+NTSTATUS DirectoryTable::Insert(PUNICODE_STRING dosName, PUNICODE_STRING ntName) {
+	if (m_Count >= m_BucketCount && !Grow())
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	auto entry = static_cast<DirectoryEntry*>(ExAllocatePoolWithTag(m_Pool, sizeof(DirectoryEntry), m_Tag));
+	if (!entry)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	auto key = TrimSeparator(dosName);
+	entry->Hash = HashName(&key);
+	entry->DosName = *dosName;
+	entry->NtName = *ntName;
+
+	auto& bucket = m_Buckets[entry->Hash & (m_BucketCount - 1)];
+	entry->Next = bucket;
+	bucket = entry;
+
+	m_Count++;
+	m_Bytes += EntrySize(dosName, ntName);
+	return STATUS_SUCCESS;
+}
+
+DirectoryEntry* DirectoryTable::Find(PCUNICODE_STRING dosName) const {
+	if (m_Count == 0)
+		return nullptr;
+
+	auto key = TrimSeparator(dosName);
+	auto hash = HashName(&key);
+	for (auto entry = m_Buckets[hash & (m_BucketCount - 1)]; entry; entry = entry->Next) {
+		if (entry->Hash != hash)
+			continue;
+		auto name = TrimSeparator(&entry->DosName);
+		if (RtlEqualUnicodeString(&key, &name, TRUE))
+			return entry;
+	}
+	return nullptr;
+}
+
+void DirectoryTable::Remove(DirectoryEntry* entry) {
+	auto link = &m_Buckets[entry->Hash & (m_BucketCount - 1)];
+	while (*link != entry)
+		link = &(*link)->Next;
+	*link = entry->Next;
+
+	m_Count--;
+	FreeEntry(entry);
+}
+
+void DirectoryTable::Swap(DirectoryTable& other) {
+	auto temp = *this;
+	*this = other;
+	other = temp;
+}
+
+bool DirectoryTable::Grow() {
+	auto count = m_BucketCount ? m_BucketCount * 2 : 16;
+	auto buckets = static_cast<DirectoryEntry**>(ExAllocatePoolWithTag(m_Pool, count * sizeof(DirectoryEntry*), m_Tag));
+	if (!buckets)
+		return false;
+
+	RtlZeroMemory(buckets, count * sizeof(DirectoryEntry*));
+	for (ULONG i = 0; i < m_BucketCount; i++) {
+		auto entry = m_Buckets[i];
+		while (entry) {
+			auto next = entry->Next;
+			auto& bucket = buckets[entry->Hash & (count - 1)];
+			entry->Next = bucket;
+			bucket = entry;
+			entry = next;
+		}
+	}
+
+	if (m_Buckets) {
+		ExFreePoolWithTag(m_Buckets, m_Tag);
+		m_Bytes -= m_BucketCount * sizeof(DirectoryEntry*);
+	}
+	m_Bytes += count * sizeof(DirectoryEntry*);
+	m_Buckets = buckets;
+	m_BucketCount = count;
+	return true;
+}
+
+void DirectoryTable::FreeEntry(DirectoryEntry* entry) {
+	m_Bytes -= EntrySize(&entry->DosName, &entry->NtName);
+	ExFreePool(entry->DosName.Buffer);
+	ExFreePool(entry->NtName.Buffer);
+	ExFreePoolWithTag(entry, m_Tag);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <ntddk.h>
+
+struct DirectoryEntry {
+	DirectoryEntry* Next;
+	ULONG Hash;
+	UNICODE_STRING DosName;
+	UNICODE_STRING NtName;
+};
+
+// Owns the configured directories, keyed by case-insensitive DOS name.
+// Chained hash table whose bucket array doubles as it fills, so adds and
+// removes are amortized O(1). Not synchronized; callers serialize access.
+class DirectoryTable final {
+public:
+	void Init(POOL_TYPE pool = PagedPool, ULONG tag = 0);
+	void Clear();
+
+	// takes ownership of both name buffers on success
+	NTSTATUS Insert(PUNICODE_STRING dosName, PUNICODE_STRING ntName);
+	DirectoryEntry* Find(PCUNICODE_STRING dosName) const;
+	void Remove(DirectoryEntry* entry);
+	void Swap(DirectoryTable& other);
+
+	template<typename TFunc>
+	void ForEach(TFunc func) const {
+		for (ULONG i = 0; i < m_BucketCount; i++)
+			for (auto entry = m_Buckets[i]; entry; entry = entry->Next)
+				func(entry);
+	}
+
+	ULONG Count() const {
+		return m_Count;
+	}
+
+	// pool memory held by entries, names and buckets
+	SIZE_T Bytes() const {
+		return m_Bytes;
+	}
+
+	static SIZE_T EntrySize(PCUNICODE_STRING dosName, PCUNICODE_STRING ntName) {
+		return sizeof(DirectoryEntry) + dosName->MaximumLength + ntName->MaximumLength;
+	}
+
+private:
+	bool Grow();
+	void FreeEntry(DirectoryEntry* entry);
+
+private:
+	DirectoryEntry** m_Buckets;
+	ULONG m_BucketCount;
+	ULONG m_Count;
+	SIZE_T m_Bytes;
+	POOL_TYPE m_Pool;
+	ULONG m_Tag;
+};
@@ -0,0 +1,231 @@
+#include "pch.h"
+#include <initguid.h>
+#include <wdmguid.h>
+#include <ntddstor.h>
+#include "DriveMap.h"
+#include "AutoLock.h"
+
+NTSTATUS DriveLetterMap::Init(PDEVICE_OBJECT deviceObject, ULONG tag) {
+	RtlZeroMemory(m_Targets, sizeof(m_Targets));
+	m_Generation = 0;
+	m_Notification = nullptr;
+	m_Tag = tag;
+	m_Lock.Init();
+	m_MountMgrFile = nullptr;
+	m_MountMgr = nullptr;
+	m_MountIrp = nullptr;
+	m_MountWork = nullptr;
+	m_Epic.EpicNumber = 0;
+	KeInitializeEvent(&m_MountIdle, NotificationEvent, TRUE);
+	m_Stopping = 0;
+
+	auto status = IoRegisterPlugPlayNotification(EventCategoryDeviceInterfaceChange, 0,
+		(PVOID)&GUID_DEVINTERFACE_VOLUME, deviceObject->DriverObject, OnVolumeChange, this, &m_Notification);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	status = StartMountWatch(deviceObject);
+	if (!NT_SUCCESS(status))
+		Shutdown();
+	return status;
+}
+
+void DriveLetterMap::Shutdown() {
+	// nothing can have been cached unless registration succeeded
+	if (!m_Notification)
+		return;
+
+	if (m_MountIrp) {
+		// a request sent after this sees m_Stopping and cancels itself
+		InterlockedExchange(&m_Stopping, 1);
+		IoCancelIrp(m_MountIrp);
+		KeWaitForSingleObject(&m_MountIdle, Executive, KernelMode, FALSE, nullptr);
+		IoFreeIrp(m_MountIrp);
+		m_MountIrp = nullptr;
+	}
+	if (m_MountWork) {
+		IoFreeWorkItem(m_MountWork);
+		m_MountWork = nullptr;
+	}
+	if (m_MountMgrFile) {
+		ObDereferenceObject(m_MountMgrFile);
+		m_MountMgrFile = nullptr;
+	}
+
+	IoUnregisterPlugPlayNotificationEx(m_Notification);
+	m_Notification = nullptr;
+	Invalidate();
+}
+
+void DriveLetterMap::Invalidate() {
+	AutoLock locker(m_Lock);
+	for (auto& target : m_Targets) {
+		if (target.Buffer) {
+			ExFreePoolWithTag(target.Buffer, m_Tag);
+			target.Buffer = nullptr;
+			target.Length = target.MaximumLength = 0;
+		}
+	}
+	m_Generation++;
+}
+
+NTSTATUS DriveLetterMap::Translate(PCWSTR dosName, PUNICODE_STRING ntName) {
+	ntName->Buffer = nullptr;
+
+	auto letter = RtlUpcaseUnicodeChar(dosName[0]);
+	if (letter < L'A' || letter > L'Z' || dosName[1] != L':')
+		return STATUS_INVALID_PARAMETER;
+	auto index = letter - L'A';
+
+	auto restLen = ::wcslen(dosName + 2) * sizeof(WCHAR);
+	for (;;) {
+		ULONG generation;
+		{
+			AutoLock locker(m_Lock);
+			auto& target = m_Targets[index];
+			if (target.Buffer) {
+				auto size = target.Length + restLen + sizeof(WCHAR);
+				if (size > MAXUSHORT)
+					return STATUS_NAME_TOO_LONG;
+
+				ntName->Buffer = (WCHAR*)ExAllocatePool(PagedPool, size);
+				if (!ntName->Buffer)
+					return STATUS_INSUFFICIENT_RESOURCES;
+				ntName->Length = 0;
+				ntName->MaximumLength = (USHORT)size;
+				RtlCopyUnicodeString(ntName, &target);
+				RtlAppendUnicodeToString(ntName, dosName + 2);	// directory
+				return STATUS_SUCCESS;
+			}
+			generation = m_Generation;
+		}
+
+		// the object manager is queried outside the lock (it needs PASSIVE_LEVEL)
+		UNICODE_STRING target;
+		auto status = QueryTarget(letter, &target);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		AutoLock locker(m_Lock);
+		// a volume change in the meantime may have made the answer stale
+		if (generation == m_Generation && !m_Targets[index].Buffer) {
+			m_Targets[index] = target;
+		}
+		else {
+			ExFreePoolWithTag(target.Buffer, m_Tag);
+		}
+	}
+}
+
+NTSTATUS DriveLetterMap::QueryTarget(WCHAR letter, PUNICODE_STRING target) {
+	// the global link, whichever session is asking
+	WCHAR name[] = L"\\GLOBAL??\\X:";
+	name[9] = letter;
+	UNICODE_STRING symLinkName;
+	RtlInitUnicodeString(&symLinkName, name);
+	OBJECT_ATTRIBUTES symLinkAttr;
+	InitializeObjectAttributes(&symLinkAttr, &symLinkName, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr, nullptr);
+
+	HANDLE hSymLink;
+	auto status = ZwOpenSymbolicLinkObject(&hSymLink, GENERIC_READ, &symLinkAttr);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	// first ask for the size, then read the target itself
+	ULONG size = 0;
+	target->Buffer = nullptr;
+	target->Length = target->MaximumLength = 0;
+	status = ZwQuerySymbolicLinkObject(hSymLink, target, &size);
+	if (status == STATUS_BUFFER_TOO_SMALL && size > 0 && size <= MAXUSHORT) {
+		target->Buffer = (WCHAR*)ExAllocatePoolWithTag(PagedPool, size, m_Tag);
+		if (!target->Buffer) {
+			status = STATUS_INSUFFICIENT_RESOURCES;
+		}
+		else {
+			target->MaximumLength = (USHORT)size;
+			status = ZwQuerySymbolicLinkObject(hSymLink, target, nullptr);
+			if (!NT_SUCCESS(status)) {
+				ExFreePoolWithTag(target->Buffer, m_Tag);
+				target->Buffer = nullptr;
+			}
+		}
+	}
+	else if (NT_SUCCESS(status)) {
+		status = STATUS_UNSUCCESSFUL;	// an empty target is of no use
+	}
+	ZwClose(hSymLink);
+	return status;
+}
+
+NTSTATUS DriveLetterMap::OnVolumeChange(PVOID notification, PVOID context) {
+	auto info = (PDEVICE_INTERFACE_CHANGE_NOTIFICATION)notification;
+	if (IsEqualGUID(info->Event, GUID_DEVICE_INTERFACE_ARRIVAL) ||
+		IsEqualGUID(info->Event, GUID_DEVICE_INTERFACE_REMOVAL)) {
+		((DriveLetterMap*)context)->Invalidate();
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS DriveLetterMap::StartMountWatch(PDEVICE_OBJECT deviceObject) {
+	UNICODE_STRING name = RTL_CONSTANT_STRING(MOUNTMGR_DEVICE_NAME);
+	auto status = IoGetDeviceObjectPointer(&name, FILE_READ_ATTRIBUTES, &m_MountMgrFile, &m_MountMgr);
+	if (!NT_SUCCESS(status)) {
+		m_MountMgrFile = nullptr;
+		return status;
+	}
+
+	m_MountIrp = IoAllocateIrp(m_MountMgr->StackSize, FALSE);
+	m_MountWork = IoAllocateWorkItem(deviceObject);
+	if (!m_MountIrp || !m_MountWork)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	// epic number 0 completes at once with the current one; after that,
+	// the request stays pending until the mount points change
+	RequestMountChange();
+	return STATUS_SUCCESS;
+}
+
+void DriveLetterMap::RequestMountChange() {
+	auto irp = m_MountIrp;
+	IoReuseIrp(irp, STATUS_SUCCESS);
+	irp->AssociatedIrp.SystemBuffer = &m_Epic;
+
+	auto stack = IoGetNextIrpStackLocation(irp);
+	stack->MajorFunction = IRP_MJ_DEVICE_CONTROL;
+	stack->FileObject = m_MountMgrFile;
+	stack->Parameters.DeviceIoControl.IoControlCode = IOCTL_MOUNTMGR_CHANGE_NOTIFY;
+	stack->Parameters.DeviceIoControl.InputBufferLength = sizeof(m_Epic);
+	stack->Parameters.DeviceIoControl.OutputBufferLength = sizeof(m_Epic);
+	IoSetCompletionRoutine(irp, OnMountChange, this, TRUE, TRUE, TRUE);
+
+	KeClearEvent(&m_MountIdle);
+	IoCallDriver(m_MountMgr, irp);
+	// Shutdown may have cancelled before the request got to the mount manager
+	if (m_Stopping)
+		IoCancelIrp(irp);
+}
+
+NTSTATUS DriveLetterMap::OnMountChange(PDEVICE_OBJECT, PIRP irp, PVOID context) {
+	auto map = (DriveLetterMap*)context;
+	if (NT_SUCCESS(irp->IoStatus.Status) && !map->m_Stopping) {
+		// possibly at DISPATCH_LEVEL; the lock and the next request need PASSIVE_LEVEL
+		IoQueueWorkItem(map->m_MountWork, OnMountChangeWork, DelayedWorkQueue, map);
+	}
+	else {
+		// cancelled, or the mount manager refused; volume arrivals still invalidate
+		if (!NT_SUCCESS(irp->IoStatus.Status) && irp->IoStatus.Status != STATUS_CANCELLED)
+			KdPrint(("DriveLetterMap: mount change request failed (0x%08X)\n", irp->IoStatus.Status));
+		KeSetEvent(&map->m_MountIdle, IO_NO_INCREMENT, FALSE);
+	}
+	// the IRP is ours and is sent again
+	return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+void DriveLetterMap::OnMountChangeWork(PDEVICE_OBJECT, PVOID context) {
+	auto map = (DriveLetterMap*)context;
+	map->Invalidate();
+	if (map->m_Stopping)
+		KeSetEvent(&map->m_MountIdle, IO_NO_INCREMENT, FALSE);
+	else
+		map->RequestMountChange();
+}
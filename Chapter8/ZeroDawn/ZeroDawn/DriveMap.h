@@ -0,0 +1,51 @@
+#pragma once
+
+#include <ntddk.h>
+#include <mountmgr.h>
+#include "FastMutex.h"
+
+// Caches the target of each \GLOBAL??\X: drive letter link
+// (\Device\HarddiskVolumeN) so converting DOS paths doesn't go to the object
+// manager for every directory. The global links are used rather than \??,
+// which resolves in the calling session's device map, so a letter mapped in
+// one session can't leak into the cache for everyone. The whole cache is
+// dropped whenever a volume interface arrives or leaves, and whenever the
+// mount manager reports a change to its mount points, which covers letters
+// reassigned without a volume coming or going. Call at PASSIVE_LEVEL.
+class DriveLetterMap final {
+public:
+	// deviceObject is this driver's, for the mount manager work item
+	NTSTATUS Init(PDEVICE_OBJECT deviceObject, ULONG tag = 0);
+	void Shutdown();
+
+	// builds the NT name of a "X:\..." path; the caller frees the
+	// buffer with ExFreePool
+	NTSTATUS Translate(PCWSTR dosName, PUNICODE_STRING ntName);
+
+	void Invalidate();
+
+private:
+	static DRIVER_NOTIFICATION_CALLBACK_ROUTINE OnVolumeChange;
+	static IO_COMPLETION_ROUTINE OnMountChange;
+	static IO_WORKITEM_ROUTINE OnMountChangeWork;
+	NTSTATUS QueryTarget(WCHAR letter, PUNICODE_STRING target);
+	NTSTATUS StartMountWatch(PDEVICE_OBJECT deviceObject);
+	void RequestMountChange();
+
+private:
+	UNICODE_STRING m_Targets[26];
+	ULONG m_Generation;
+	FastMutex m_Lock;
+	PVOID m_Notification;
+	ULONG m_Tag;
+
+	// an IOCTL_MOUNTMGR_CHANGE_NOTIFY request is kept pending with the mount
+	// manager; each completion invalidates the cache and sends it again
+	PFILE_OBJECT m_MountMgrFile;
+	PDEVICE_OBJECT m_MountMgr;
+	PIRP m_MountIrp;
+	PIO_WORKITEM m_MountWork;
+	MOUNTMGR_CHANGE_NOTIFY_INFO m_Epic;
+	KEVENT m_MountIdle;		// signaled while no request is outstanding
+	LONG volatile m_Stopping;
+};
@@ -0,0 +1,244 @@
+#include "pch.h"
+#include "PathTrie.h"
+#include "UnicodeFold.h"
+
+namespace {
+	// scans the next backslash-delimited component of path starting at pos,
+	// hashing its folded characters on the way
+	bool NextComponent(PCWCH path, USHORT count, USHORT& pos, PCWCH& name, USHORT& len, ULONG& hash) {
+		while (pos < count && path[pos] == L'\\')
+			pos++;
+		if (pos == count)
+			return false;
+
+		auto start = pos;
+		hash = FoldHashSeed;
+		for (; pos < count && path[pos] != L'\\'; pos++)
+			hash = FoldHashStep(hash, path[pos]);
+
+		name = path + start;
+		len = pos - start;
+		return true;
+	}
+}
+
+void PathTrie::Init(POOL_TYPE pool, ULONG tag) {
+	RtlZeroMemory(&m_Root, sizeof(m_Root));
+	m_Count = 0;
+	m_Bytes = 0;
+	m_Pool = pool;
+	m_Tag = tag;
+}
+
+void PathTrie::Clear() {
+	// iterative post-order walk; ChildCapacity doubles as the scan cursor
+	// since the tables are discarded anyway
+	auto node = &m_Root;
+	while (node) {
+		PathTrieNode* next = nullptr;
+		while (node->ChildCapacity > 0) {
+			next = node->Children[--node->ChildCapacity];
+			if (next)
+				break;
+		}
+		if (next) {
+			node = next;
+			continue;
+		}
+
+		auto parent = node->Parent;
+		if (node->Children)
+			ExFreePoolWithTag(node->Children, m_Tag);
+		if (node != &m_Root)
+			ExFreePoolWithTag(node, m_Tag);
+		node = parent;
+	}
+
+	RtlZeroMemory(&m_Root, sizeof(m_Root));
+	m_Count = 0;
+	m_Bytes = 0;
+}
+
+NTSTATUS PathTrie::Insert(PCUNICODE_STRING path) {
+	auto count = static_cast<USHORT>(path->Length / sizeof(WCHAR));
+	USHORT pos = 0, len;
+	PCWCH name;
+	ULONG hash;
+
+	auto node = &m_Root;
+	while (NextComponent(path->Buffer, count, pos, name, len, hash)) {
+		auto child = FindChild(node, name, len, hash);
+		if (!child) {
+			child = AddChild(node, name, len, hash);
+			if (!child) {
+				// drop whatever part of the chain we created
+				Prune(node);
+				return STATUS_INSUFFICIENT_RESOURCES;
+			}
+		}
+		node = child;
+	}
+
+	if (node == &m_Root)
+		return STATUS_INVALID_PARAMETER;
+
+	if (node->Terminal++ == 0)
+		m_Count++;
+	return STATUS_SUCCESS;
+}
+
+bool PathTrie::Remove(PCUNICODE_STRING path) {
+	auto count = static_cast<USHORT>(path->Length / sizeof(WCHAR));
+	USHORT pos = 0, len;
+	PCWCH name;
+	ULONG hash;
+
+	auto node = &m_Root;
+	while (NextComponent(path->Buffer, count, pos, name, len, hash)) {
+		node = FindChild(node, name, len, hash);
+		if (!node)
+			return false;
+	}
+
+	if (node == &m_Root || !node->Terminal)
+		return false;
+
+	if (--node->Terminal == 0) {
+		m_Count--;
+		Prune(node);
+	}
+	return true;
+}
+
+bool PathTrie::MatchPrefix(PCUNICODE_STRING path) const {
+	if (m_Count == 0)
+		return false;
+
+	auto count = static_cast<USHORT>(path->Length / sizeof(WCHAR));
+	USHORT pos = 0, len;
+	PCWCH name;
+	ULONG hash;
+
+	const PathTrieNode* node = &m_Root;
+	while (NextComponent(path->Buffer, count, pos, name, len, hash)) {
+		// the last component is the file itself, not a directory
+		if (pos == count)
+			break;
+
+		node = FindChild(node, name, len, hash);
+		if (!node)
+			return false;
+		if (node->Terminal)
+			return true;
+	}
+	return false;
+}
+
+PathTrieNode* PathTrie::FindChild(const PathTrieNode* node, PCWCH name, USHORT len, ULONG hash) const {
+	if (node->ChildCount == 0)
+		return nullptr;
+
+	auto mask = node->ChildCapacity - 1;
+	for (auto i = hash & mask; ; i = (i + 1) & mask) {
+		auto child = node->Children[i];
+		if (!child)
+			return nullptr;
+		if (child->Hash == hash && child->Length == len && EqualFolded(child->Name, name, len))
+			return child;
+	}
+}
+
+PathTrieNode* PathTrie::AddChild(PathTrieNode* node, PCWCH name, USHORT len, ULONG hash) {
+	// keep the load factor at or below 3/4 so probes always hit an empty slot
+	if ((node->ChildCount + 1) * 4 > node->ChildCapacity * 3) {
+		if (!GrowChildren(node))
+			return nullptr;
+	}
+
+	auto size = sizeof(PathTrieNode) + len * sizeof(WCHAR);
+	auto child = static_cast<PathTrieNode*>(ExAllocatePoolWithTag(m_Pool, size, m_Tag));
+	if (!child)
+		return nullptr;
+	m_Bytes += size;
+
+	RtlZeroMemory(child, sizeof(PathTrieNode));
+	child->Parent = node;
+	child->Hash = hash;
+	child->Length = len;
+	for (USHORT i = 0; i < len; i++)
+		child->Name[i] = FoldChar(name[i]);
+
+	auto mask = node->ChildCapacity - 1;
+	auto i = hash & mask;
+	while (node->Children[i])
+		i = (i + 1) & mask;
+	node->Children[i] = child;
+	node->ChildCount++;
+	return child;
+}
+
+void PathTrie::RemoveChild(PathTrieNode* node, PathTrieNode* child) {
+	auto mask = node->ChildCapacity - 1;
+	auto i = child->Hash & mask;
+	while (node->Children[i] != child)
+		i = (i + 1) & mask;
+	node->Children[i] = nullptr;
+	node->ChildCount--;
+
+	// re-seat the rest of the probe cluster so lookups don't stop early
+	for (auto j = (i + 1) & mask; node->Children[j]; j = (j + 1) & mask) {
+		auto moved = node->Children[j];
+		node->Children[j] = nullptr;
+		auto k = moved->Hash & mask;
+		while (node->Children[k])
+			k = (k + 1) & mask;
+		node->Children[k] = moved;
+	}
+}
+
+bool PathTrie::GrowChildren(PathTrieNode* node) {
+	auto capacity = node->ChildCapacity ? node->ChildCapacity * 2 : 4;
+	auto children = static_cast<PathTrieNode**>(ExAllocatePoolWithTag(m_Pool,
+		capacity * sizeof(PathTrieNode*), m_Tag));
+	if (!children)
+		return false;
+
+	RtlZeroMemory(children, capacity * sizeof(PathTrieNode*));
+	auto mask = capacity - 1;
+	for (ULONG i = 0; i < node->ChildCapacity; i++) {
+		auto child = node->Children[i];
+		if (!child)
+			continue;
+		auto k = child->Hash & mask;
+		while (children[k])
+			k = (k + 1) & mask;
+		children[k] = child;
+	}
+
+	if (node->Children) {
+		ExFreePoolWithTag(node->Children, m_Tag);
+		m_Bytes -= node->ChildCapacity * sizeof(PathTrieNode*);
+	}
+	m_Bytes += capacity * sizeof(PathTrieNode*);
+	node->Children = children;
+	node->ChildCapacity = capacity;
+	return true;
+}
+
+void PathTrie::Prune(PathTrieNode* node) {
+	while (node != &m_Root && !node->Terminal && node->ChildCount == 0) {
+		auto parent = node->Parent;
+		RemoveChild(parent, node);
+		FreeNode(node);
+		node = parent;
+	}
+}
+
+void PathTrie::FreeNode(PathTrieNode* node) {
+	if (node->Children) {
+		ExFreePoolWithTag(node->Children, m_Tag);
+		m_Bytes -= node->ChildCapacity * sizeof(PathTrieNode*);
+	}
+	m_Bytes -= sizeof(PathTrieNode) + node->Length * sizeof(WCHAR);
+	ExFreePoolWithTag(node, m_Tag);
+}
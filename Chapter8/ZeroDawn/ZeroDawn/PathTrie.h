@@ -0,0 +1,58 @@
+#pragma once
+
+#include <ntddk.h>
+
+// A node holds one upper-cased path component ("C:", "TEMP", ...).
+// Children live in an open-addressed table keyed by the component hash,
+// so descending one level costs O(component length).
+struct PathTrieNode {
+	PathTrieNode* Parent;
+	PathTrieNode** Children;
+	ULONG ChildCapacity;
+	ULONG ChildCount;
+	ULONG Hash;
+	USHORT Length;
+	ULONG Terminal;		// times the path ending here was inserted
+	WCHAR Name[1];
+};
+
+// Component-aware, case-insensitive prefix trie of directory paths.
+// Not synchronized; callers serialize writers and readers.
+class PathTrie final {
+public:
+	void Init(POOL_TYPE pool = PagedPool, ULONG tag = 0);
+	void Clear();
+
+	// a path may be inserted more than once; it stays until removed as often
+	NTSTATUS Insert(PCUNICODE_STRING path);
+	bool Remove(PCUNICODE_STRING path);
+
+	// true if a stored directory is a proper prefix of path, i.e. path
+	// names a file somewhere below one of the stored directories
+	bool MatchPrefix(PCUNICODE_STRING path) const;
+
+	// distinct paths
+	ULONG Count() const {
+		return m_Count;
+	}
+
+	// pool memory held by nodes and child tables
+	SIZE_T Bytes() const {
+		return m_Bytes;
+	}
+
+private:
+	PathTrieNode* FindChild(const PathTrieNode* node, PCWCH name, USHORT len, ULONG hash) const;
+	PathTrieNode* AddChild(PathTrieNode* node, PCWCH name, USHORT len, ULONG hash);
+	void RemoveChild(PathTrieNode* node, PathTrieNode* child);
+	bool GrowChildren(PathTrieNode* node);
+	void Prune(PathTrieNode* node);
+	void FreeNode(PathTrieNode* node);
+
+private:
+	PathTrieNode m_Root;
+	ULONG m_Count;
+	SIZE_T m_Bytes;
+	POOL_TYPE m_Pool;
+	ULONG m_Tag;
+};
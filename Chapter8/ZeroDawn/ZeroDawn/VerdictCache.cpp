@@ -0,0 +1,98 @@
+#include "pch.h"
+#include "VerdictCache.h"
+#include "UnicodeFold.h"
+#include "ZeroCommon.h"
+
+// folds the path once, so the comparison under the spin lock is a plain
+// memory compare
+void VerdictCache::MakeKey(PCUNICODE_STRING path, Key& key) {
+	auto len = path->Length / sizeof(WCHAR);
+	key.Length = 0;
+	if (len == 0 || len > MaxPathLength)
+		return;
+
+	auto hash = FoldHashSeed;
+	for (USHORT i = 0; i < len; i++) {
+		key.Name[i] = FoldChar(path->Buffer[i]);
+		hash = (hash ^ key.Name[i]) * FoldHashPrime;
+	}
+	key.Hash = hash;
+	key.Length = (USHORT)len;
+}
+
+void VerdictCache::Init(ULONG tag) {
+	RtlZeroMemory(m_Slots, sizeof(m_Slots));
+	m_Lock = 0;
+	m_Count = 0;
+	m_Hits = m_Misses = m_Evictions = 0;
+	m_Tag = tag;
+}
+
+void VerdictCache::Flush() {
+	auto irql = ExAcquireSpinLockExclusive(&m_Lock);
+	for (auto& entry : m_Slots) {
+		if (entry) {
+			ExFreePoolWithTag(entry, m_Tag);
+			entry = nullptr;
+		}
+	}
+	m_Count = 0;
+	ExReleaseSpinLockExclusive(&m_Lock, irql);
+}
+
+bool VerdictCache::Lookup(const Key& key, ULONG generation, bool& blocked) {
+	if (key.Length == 0) {
+		InterlockedIncrement(&m_Misses);
+		return false;
+	}
+
+	auto found = false;
+	auto irql = ExAcquireSpinLockShared(&m_Lock);
+	auto entry = m_Slots[key.Hash & (SlotCount - 1)];
+	if (entry && entry->Hash == key.Hash && entry->Generation == generation && entry->Length == key.Length
+		&& RtlEqualMemory(entry->Name, key.Name, key.Length * sizeof(WCHAR))) {
+		blocked = entry->Blocked;
+		found = true;
+	}
+	ExReleaseSpinLockShared(&m_Lock, irql);
+
+	InterlockedIncrement(found ? &m_Hits : &m_Misses);
+	return found;
+}
+
+void VerdictCache::Insert(const Key& key, ULONG generation, bool blocked) {
+	if (key.Length == 0)
+		return;
+
+	auto entry = (VerdictEntry*)ExAllocatePoolWithTag(NonPagedPoolNx,
+		sizeof(VerdictEntry) + key.Length * sizeof(WCHAR), m_Tag);
+	if (!entry)
+		return;
+
+	entry->Hash = key.Hash;
+	entry->Generation = generation;
+	entry->Length = key.Length;
+	entry->Blocked = blocked;
+	RtlCopyMemory(entry->Name, key.Name, key.Length * sizeof(WCHAR));
+
+	auto irql = ExAcquireSpinLockExclusive(&m_Lock);
+	auto& slot = m_Slots[key.Hash & (SlotCount - 1)];
+	auto old = slot;
+	slot = entry;
+	if (!old)
+		m_Count++;
+	ExReleaseSpinLockExclusive(&m_Lock, irql);
+
+	if (old) {
+		InterlockedIncrement(&m_Evictions);
+		ExFreePoolWithTag(old, m_Tag);
+	}
+}
+
+void VerdictCache::GetStats(VerdictCacheStats* stats) const {
+	stats->Hits = m_Hits;
+	stats->Misses = m_Misses;
+	stats->Evictions = m_Evictions;
+	stats->Entries = m_Count;
+	stats->Capacity = SlotCount;
+}
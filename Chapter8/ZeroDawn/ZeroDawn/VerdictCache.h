@@ -0,0 +1,51 @@
+#pragma once
+
+#include <ntddk.h>
+
+struct VerdictCacheStats;
+
+struct VerdictEntry {
+	ULONG Hash;
+	ULONG Generation;
+	USHORT Length;
+	bool Blocked;
+	WCHAR Name[1];	// upper-cased
+};
+
+// Remembers the allow/deny outcome for recently launched images so repeat
+// launches skip the rule walk. Direct-mapped on the folded path hash: a
+// colliding insert evicts the previous occupant, which bounds memory at
+// SlotCount entries. Every entry is stamped with the rule generation it was
+// computed under and only counts as a hit for that same generation.
+// A path is folded once into a Key, which the Lookup and, on a miss, the
+// Insert that follows both take. Lookup/Insert at PASSIVE_LEVEL.
+class VerdictCache final {
+public:
+	static const ULONG SlotCount = 1024;
+	// longer paths are simply not cached
+	static const USHORT MaxPathLength = 260;
+
+	// a path upper-cased, with its hash; Length is zero if it can't be cached
+	struct Key {
+		ULONG Hash;
+		USHORT Length;
+		WCHAR Name[MaxPathLength];
+	};
+
+	static void MakeKey(PCUNICODE_STRING path, Key& key);
+
+	void Init(ULONG tag = 0);
+	void Flush();
+
+	bool Lookup(const Key& key, ULONG generation, bool& blocked);
+	void Insert(const Key& key, ULONG generation, bool blocked);
+
+	void GetStats(VerdictCacheStats* stats) const;
+
+private:
+	VerdictEntry* m_Slots[SlotCount];
+	EX_SPIN_LOCK m_Lock;
+	LONG volatile m_Count;
+	LONG volatile m_Hits, m_Misses, m_Evictions;
+	ULONG m_Tag;
+};
@@ -3,5 +3,30 @@
 #define IOCTL_DELPROTECT_ADD_DIR	CTL_CODE(0x8000, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_DELPROTECT_REMOVE_DIR CTL_CODE(0x8000, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_DELPROTECT_CLEAR		CTL_CODE(0x8000, 0x802, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_DELPROTECT_SET_LIMIT	CTL_CODE(0x8000, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_DELPROTECT_LOAD_DIRS	CTL_CODE(0x8000, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_DELPROTECT_GET_STATS	CTL_CODE(0x8000, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+// in characters, excluding the terminating NULL
+const int MaxDirNameLength = 511;
 
+// IOCTL_DELPROTECT_LOAD_DIRS input: a header followed by Count packed
+// records, each a byte length and that many bytes of name (no NULL).
+// The loaded list replaces all existing directories at once.
+struct DirListHeader {
+	ULONG Count;
+};
+
+struct DirListEntry {
+	USHORT Length;
+	WCHAR Name[1];
+};
+
+// IOCTL_DELPROTECT_GET_STATS output
+struct VerdictCacheStats {
+	ULONG Hits;
+	ULONG Misses;
+	ULONG Evictions;
+	ULONG Entries;
+	ULONG Capacity;
+};
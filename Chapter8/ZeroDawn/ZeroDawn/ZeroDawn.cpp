@@ -3,7 +3,11 @@
 #include "FastMutex.h"
 #include "ZeroCommon.h"
 #include "Zero.h"
-#include "kstring.h"
+#include "PathTrie.h"
+#include "DirectoryTable.h"
+#include "Snapshot.h"
+#include "DriveMap.h"
+#include "VerdictCache.h"
 
 #define DRIVER_PREFIX "Zero: "
 #define DRIVER_TAG 'oreZ'
@@ -11,35 +15,50 @@
 // globals
 Globals g_Globals;
 
-struct DirectoryEntry {
-	UNICODE_STRING DosName;
-	UNICODE_STRING NtName;
-
-	void Free() {
-		if (DosName.Buffer) {
-			ExFreePool(DosName.Buffer);
-			DosName.Buffer = nullptr;
-		}
-
-		if (NtName.Buffer) {
-			ExFreePool(NtName.Buffer);
-			NtName.Buffer = nullptr;
-		}
-	}
+// default ceiling on pool used by the directory rules,
+// adjustable with IOCTL_DELPROTECT_SET_LIMIT
+const SIZE_T DefaultDirMemoryLimit = 16 * 1024 * 1024;
+
+// what OnProcessNotify matches against: both the DOS and the NT form of
+// every directory, so image names match without conversion. Kept twice,
+// left-right style: an add or remove is applied to the spare copy, which is
+// then published; once readers have drained off the retired copy, the same
+// change is applied to it and it becomes the spare. A single change thus
+// costs O(path length) rather than a rebuild. Bulk loads and clears publish
+// a fresh copy, and the spare is rebuilt from DirTable on the next change.
+struct DirSnapshot {
+	PathTrie Trie;
+	ULONG Generation;
 };
 
-const int MaxDirectories = 4;
-DirectoryEntry DirNames[MaxDirectories];
-int DirNamesCount;
+DirectoryTable DirTable;
+SnapshotSlot<DirSnapshot> DirSnapshots;
+// same directories as the published snapshot; null until rebuilt
+DirSnapshot* DirSpare;
+// both copies, counted against DirMemoryLimit
+SIZE_T DirSnapshotBytes;
+SIZE_T DirMemoryLimit = DefaultDirMemoryLimit;
 FastMutex DirNamesLock;
+DriveLetterMap DriveMap;
+// verdicts are only trusted for the generation they were computed under
+VerdictCache Verdicts;
+ULONG DirGeneration;
 
 
 /*************************************************************************
 	Prototypes
 *************************************************************************/
 
-int FindDirectory(_In_ PCUNICODE_STRING name, bool dosName);
+void StripDosDevicesPrefix(_Inout_ PUNICODE_STRING path);
+NTSTATUS BuildSnapshot(const DirectoryTable& table, DirSnapshot*& snapshot);
+NTSTATUS PrepareSpare();
+NTSTATUS UpdateDirectories(PCUNICODE_STRING dosName, PCUNICODE_STRING ntName, bool add);
+void ReplaceDirectories(DirSnapshot* snapshot);
+DirSnapshot* PublishSnapshot(DirSnapshot* snapshot);
+void FreeSnapshot(DirSnapshot* snapshot);
 NTSTATUS ConvertDosNameToNtName(_In_ PCWSTR dosName, _Out_ PUNICODE_STRING ntName);
+NTSTATUS CreateDirectoryNames(_In_ PCWCH name, _In_ ULONG len, _Out_ PUNICODE_STRING dosName, _Out_ PUNICODE_STRING ntName);
+NTSTATUS LoadDirectories(_In_ PVOID buffer, _In_ ULONG size);
 
 DRIVER_DISPATCH DelProtectCreateClose, DelProtectDeviceControl;
 DRIVER_UNLOAD DelProtectUnloadDriver;
@@ -74,6 +93,17 @@ DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING RegistryPath)
 
 		symLinkCreated = true;
 
+		DirNamesLock.Init();
+		DirTable.Init(PagedPool, DRIVER_TAG);
+		Verdicts.Init(DRIVER_TAG);
+		status = DirSnapshots.Init(DRIVER_TAG);
+		if (!NT_SUCCESS(status))
+			break;
+
+		status = DriveMap.Init(DeviceObject, DRIVER_TAG);
+		if (!NT_SUCCESS(status))
+			break;
+
 		// Register for Process Notifications
 		status = PsSetCreateProcessNotifyRoutineEx(OnProcessNotify, FALSE);
 		if (!NT_SUCCESS(status)) {
@@ -85,7 +115,6 @@ DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING RegistryPath)
 		DriverObject->DriverUnload = DelProtectUnloadDriver;
 		DriverObject->MajorFunction[IRP_MJ_CREATE] = DriverObject->MajorFunction[IRP_MJ_CLOSE] = DelProtectCreateClose;
 		DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = DelProtectDeviceControl;
-		DirNamesLock.Init();
 
 	} while (false);
 
@@ -93,6 +122,8 @@ DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING RegistryPath)
 
 		if (processCallbacks)
 			PsSetCreateProcessNotifyRoutineEx(OnProcessNotify, TRUE);
+		DriveMap.Shutdown();
+		DirSnapshots.Shutdown();
 		if (symLinkCreated)
 			IoDeleteSymbolicLink(&symLink);
 		if (DeviceObject)
@@ -112,6 +143,7 @@ NTSTATUS DelProtectCreateClose(PDEVICE_OBJECT, PIRP Irp) {
 NTSTATUS DelProtectDeviceControl(PDEVICE_OBJECT, PIRP Irp) {
 	auto stack = IoGetCurrentIrpStackLocation(Irp);
 	auto status = STATUS_SUCCESS;
+	ULONG_PTR information = 0;
 
 	switch (stack->Parameters.DeviceIoControl.IoControlCode) {
 	case IOCTL_DELPROTECT_ADD_DIR:
@@ -141,40 +173,34 @@ NTSTATUS DelProtectDeviceControl(PDEVICE_OBJECT, PIRP Irp) {
 		AutoLock locker(DirNamesLock);
 		UNICODE_STRING strName;
 		RtlInitUnicodeString(&strName, name);
-		if (FindDirectory(&strName, true) >= 0) {
+		if (DirTable.Find(&strName)) {
 			break;
 		}
 
-		if (DirNamesCount == MaxDirectories) {
-			status = STATUS_TOO_MANY_NAMES;
+		UNICODE_STRING dosName, ntName;
+		status = CreateDirectoryNames(name, (ULONG)dosNameLen, &dosName, &ntName);
+		if (!NT_SUCCESS(status))
 			break;
-		}
 
-		for (int i = 0; i < MaxDirectories; i++) {
-			if (DirNames[i].DosName.Buffer == nullptr) {
-				auto len = (dosNameLen + 2) * sizeof(WCHAR);
-				auto buffer = (WCHAR*)ExAllocatePoolWithTag(PagedPool, len, DRIVER_TAG);
-				if (!buffer) {
-					status = STATUS_INSUFFICIENT_RESOURCES;
-					break;
-				}
-				::wcscpy_s(buffer, len / sizeof(WCHAR), name);
-				// append a backslash if it's missing
-				if (name[dosNameLen - 1] != L'\\')
-					::wcscat_s(buffer, dosNameLen + 2, L"\\");
-
-				status = ConvertDosNameToNtName(buffer, &DirNames[i].NtName);
-				if (!NT_SUCCESS(status)) {
-					ExFreePool(buffer);
-					break;
-				}
+		if (DirTable.Bytes() + DirSnapshotBytes + DirectoryTable::EntrySize(&dosName, &ntName) > DirMemoryLimit)
+			status = STATUS_QUOTA_EXCEEDED;
+		else
+			status = PrepareSpare();
+		if (NT_SUCCESS(status))
+			status = DirTable.Insert(&dosName, &ntName);
 
-				RtlInitUnicodeString(&DirNames[i].DosName, buffer);
-				KdPrint(("Add: %wZ <=> %wZ\n", &DirNames[i].DosName, &DirNames[i].NtName));
-				++DirNamesCount;
-				break;
-			}
+		if (!NT_SUCCESS(status)) {
+			ExFreePool(dosName.Buffer);
+			ExFreePool(ntName.Buffer);
+			break;
 		}
+
+		status = UpdateDirectories(&dosName, &ntName, true);
+		if (!NT_SUCCESS(status)) {
+			DirTable.Remove(DirTable.Find(&dosName));
+			break;
+		}
+		KdPrint(("Add: %wZ <=> %wZ\n", &dosName, &ntName));
 		break;
 	}
 
@@ -205,14 +231,18 @@ NTSTATUS DelProtectDeviceControl(PDEVICE_OBJECT, PIRP Irp) {
 		AutoLock locker(DirNamesLock);
 		UNICODE_STRING strName;
 		RtlInitUnicodeString(&strName, name);
-		int found = FindDirectory(&strName, true);
-		if (found >= 0) {
-			DirNames[found].Free();
-			DirNamesCount--;
-		}
-		else {
+		auto entry = DirTable.Find(&strName);
+		if (!entry) {
 			status = STATUS_NOT_FOUND;
+			break;
 		}
+
+		// the snapshots still use the entry's names, so it goes from the table last
+		status = PrepareSpare();
+		if (NT_SUCCESS(status))
+			status = UpdateDirectories(&entry->DosName, &entry->NtName, false);
+		if (NT_SUCCESS(status))
+			DirTable.Remove(entry);
 		break;
 	}
 
@@ -220,55 +250,258 @@ NTSTATUS DelProtectDeviceControl(PDEVICE_OBJECT, PIRP Irp) {
 		ClearAll();
 		break;
 
+	case IOCTL_DELPROTECT_LOAD_DIRS:
+	{
+		auto buffer = Irp->AssociatedIrp.SystemBuffer;
+		if (!buffer) {
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		status = LoadDirectories(buffer, stack->Parameters.DeviceIoControl.InputBufferLength);
+		break;
+	}
+
+	case IOCTL_DELPROTECT_SET_LIMIT:
+	{
+		auto limit = (ULONG*)Irp->AssociatedIrp.SystemBuffer;
+		if (!limit || stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG)) {
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+
+		// existing rules are kept, the new ceiling only applies to later adds
+		AutoLock locker(DirNamesLock);
+		DirMemoryLimit = *limit;
+		break;
+	}
+
+	case IOCTL_DELPROTECT_GET_STATS:
+	{
+		auto stats = (VerdictCacheStats*)Irp->AssociatedIrp.SystemBuffer;
+		if (!stats || stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(VerdictCacheStats)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		Verdicts.GetStats(stats);
+		information = sizeof(VerdictCacheStats);
+		break;
+	}
+
 	default:
 		status = STATUS_INVALID_DEVICE_REQUEST;
 		break;
 	}
 
 	Irp->IoStatus.Status = status;
-	Irp->IoStatus.Information = 0;
+	Irp->IoStatus.Information = information;
 	IoCompleteRequest(Irp, IO_NO_INCREMENT);
 	return status;
 
 }
 
-int FindDirectory(PCUNICODE_STRING name, bool dosName) {
-	if (DirNamesCount == 0)
-		return -1;
+NTSTATUS CreateDirectoryNames(PCWCH name, ULONG len, PUNICODE_STRING dosName, PUNICODE_STRING ntName) {
+	auto size = (len + 2) * sizeof(WCHAR);
+	auto buffer = (WCHAR*)ExAllocatePoolWithTag(PagedPool, size, DRIVER_TAG);
+	if (!buffer)
+		return STATUS_INSUFFICIENT_RESOURCES;
 
-	for (int i = 0; i < MaxDirectories; i++) {
-		const auto& dir = dosName ? DirNames[i].DosName : DirNames[i].NtName;
-		
-		KdPrint(("FindDir - DosName: %ws\n", DirNames[i].DosName.Buffer));
+	::wcsncpy_s(buffer, size / sizeof(WCHAR), name, len);
+	// append a backslash if it's missing
+	if (name[len - 1] != L'\\')
+		::wcscat_s(buffer, size / sizeof(WCHAR), L"\\");
 
-		//if (dir.Buffer && RtlEqualUnicodeString(name, &dir, TRUE))
-		if (dir.Buffer && wcsstr(name->Buffer, DirNames[i].DosName.Buffer) != nullptr)
-		{
-			KdPrint(("DirName Found at index: %d\n", i));
-			return i;
+	auto status = ConvertDosNameToNtName(buffer, ntName);
+	if (!NT_SUCCESS(status)) {
+		ExFreePool(buffer);
+		return status;
+	}
+
+	RtlInitUnicodeString(dosName, buffer);
+	dosName->MaximumLength = (USHORT)size;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS LoadDirectories(PVOID buffer, ULONG size) {
+	// validate the whole list before converting anything
+	if (size < sizeof(DirListHeader))
+		return STATUS_INVALID_PARAMETER;
+
+	auto header = (DirListHeader*)buffer;
+	auto data = (PUCHAR)(header + 1);
+	auto remaining = size - sizeof(DirListHeader);
+	for (ULONG i = 0; i < header->Count; i++) {
+		if (remaining < sizeof(USHORT))
+			return STATUS_INVALID_PARAMETER;
+		auto record = (DirListEntry*)data;
+		auto len = record->Length;
+		if (len % sizeof(WCHAR) || len < 3 * sizeof(WCHAR) || len > MaxDirNameLength * sizeof(WCHAR)
+			|| remaining - sizeof(USHORT) < len)
+			return STATUS_INVALID_PARAMETER;
+		data += sizeof(USHORT) + len;
+		remaining -= sizeof(USHORT) + len;
+	}
+
+	// build the new set off to the side; readers keep the current one meanwhile
+	DirectoryTable table;
+	table.Init(PagedPool, DRIVER_TAG);
+	auto status = STATUS_SUCCESS;
+	data = (PUCHAR)(header + 1);
+	for (ULONG i = 0; i < header->Count && NT_SUCCESS(status); i++) {
+		auto record = (DirListEntry*)data;
+		data += sizeof(USHORT) + record->Length;
+
+		UNICODE_STRING dosName, ntName;
+		status = CreateDirectoryNames(record->Name, record->Length / sizeof(WCHAR), &dosName, &ntName);
+		if (!NT_SUCCESS(status))
+			break;
+
+		if (table.Find(&dosName))
+			status = STATUS_OBJECT_NAME_COLLISION;
+		else if (table.Bytes() + DirectoryTable::EntrySize(&dosName, &ntName) > DirMemoryLimit)
+			status = STATUS_QUOTA_EXCEEDED;
+		else
+			status = table.Insert(&dosName, &ntName);
+
+		if (status == STATUS_OBJECT_NAME_COLLISION)
+			status = STATUS_SUCCESS;	// duplicates in the list are harmless
+		if (!NT_SUCCESS(status)) {
+			ExFreePool(dosName.Buffer);
+			ExFreePool(ntName.Buffer);
 		}
 	}
-	return -1;
+
+	// the quota covers the tries as for single adds, the spare included
+	DirSnapshot* snapshot = nullptr;
+	if (NT_SUCCESS(status) && table.Count() > 0) {
+		status = BuildSnapshot(table, snapshot);
+		if (NT_SUCCESS(status) && table.Bytes() + 2 * snapshot->Trie.Bytes() > DirMemoryLimit) {
+			FreeSnapshot(snapshot);
+			status = STATUS_QUOTA_EXCEEDED;
+		}
+	}
+
+	if (NT_SUCCESS(status)) {
+		AutoLock locker(DirNamesLock);
+		DirTable.Swap(table);
+		ReplaceDirectories(snapshot);
+	}
+
+	KdPrint((DRIVER_PREFIX "Loaded %u directories (0x%08X)\n", header->Count, status));
+	table.Clear();
+	return status;
+}
+
+void StripDosDevicesPrefix(PUNICODE_STRING path) {
+	// image names arrive as \??\C:\..., rules are stored as C:\...
+	UNICODE_STRING prefix = RTL_CONSTANT_STRING(L"\\??\\");
+	if (RtlPrefixUnicodeString(&prefix, path, FALSE)) {
+		path->Buffer += prefix.Length / sizeof(WCHAR);
+		path->Length -= prefix.Length;
+		path->MaximumLength -= prefix.Length;
+	}
 }
 
 void ClearAll() {
 	AutoLock locker(DirNamesLock);
-	for (int i = 0; i < MaxDirectories; i++) {
-		if (DirNames[i].DosName.Buffer) {
-			ExFreePool(DirNames[i].DosName.Buffer);
-			DirNames[i].DosName.Buffer = nullptr;
-		}
-		if (DirNames[i].NtName.Buffer) {
-			ExFreePool(DirNames[i].NtName.Buffer);
-			DirNames[i].NtName.Buffer = nullptr;
-		}
+	DirTable.Clear();
+	ReplaceDirectories(nullptr);
+}
+
+NTSTATUS BuildSnapshot(const DirectoryTable& table, DirSnapshot*& snapshot) {
+	snapshot = (DirSnapshot*)ExAllocatePoolWithTag(PagedPool, sizeof(DirSnapshot), DRIVER_TAG);
+	if (!snapshot)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	snapshot->Trie.Init(PagedPool, DRIVER_TAG);
+	snapshot->Generation = 0;
+	auto status = STATUS_SUCCESS;
+	table.ForEach([&](const DirectoryEntry* entry) {
+		if (NT_SUCCESS(status))
+			status = snapshot->Trie.Insert(&entry->DosName);
+		if (NT_SUCCESS(status))
+			status = snapshot->Trie.Insert(&entry->NtName);
+	});
+	if (!NT_SUCCESS(status)) {
+		FreeSnapshot(snapshot);
+		snapshot = nullptr;
+	}
+	return status;
+}
+
+// makes sure there is a spare to apply the next change to; DirTable must
+// not have that change yet
+NTSTATUS PrepareSpare() {
+	if (DirSpare)
+		return STATUS_SUCCESS;
+	return BuildSnapshot(DirTable, DirSpare);
+}
+
+// all or nothing: a failed add leaves the snapshot as it was
+NTSTATUS ApplyChange(DirSnapshot* snapshot, PCUNICODE_STRING dosName, PCUNICODE_STRING ntName, bool add) {
+	if (!add) {
+		snapshot->Trie.Remove(dosName);
+		snapshot->Trie.Remove(ntName);
+		return STATUS_SUCCESS;
+	}
+
+	auto status = snapshot->Trie.Insert(dosName);
+	if (NT_SUCCESS(status)) {
+		status = snapshot->Trie.Insert(ntName);
+		if (!NT_SUCCESS(status))
+			snapshot->Trie.Remove(dosName);
+	}
+	return status;
+}
+
+// applies one add or remove to the spare, publishes it and brings the
+// retired copy up to date as the next spare; needs PrepareSpare first
+NTSTATUS UpdateDirectories(PCUNICODE_STRING dosName, PCUNICODE_STRING ntName, bool add) {
+	auto status = ApplyChange(DirSpare, dosName, ntName, add);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	DirSpare = PublishSnapshot(DirSpare);
+	if (DirSpare && !NT_SUCCESS(ApplyChange(DirSpare, dosName, ntName, add))) {
+		// out of sync now; rebuilt by the next change
+		FreeSnapshot(DirSpare);
+		DirSpare = nullptr;
+	}
+	return STATUS_SUCCESS;
+}
+
+// publishes a snapshot built from scratch (null when there are no directories)
+void ReplaceDirectories(DirSnapshot* snapshot) {
+	FreeSnapshot(PublishSnapshot(snapshot));
+	FreeSnapshot(DirSpare);
+	DirSpare = nullptr;
+}
+
+// returns the previous snapshot, which readers no longer see
+DirSnapshot* PublishSnapshot(DirSnapshot* snapshot) {
+	if (snapshot)
+		snapshot->Generation = DirGeneration + 1;
+	// readers still holding the old snapshot are drained before it comes back
+	auto previous = DirSnapshots.Publish(snapshot);
+	DirSnapshotBytes = snapshot ? 2 * snapshot->Trie.Bytes() : 0;
+	DirGeneration++;
+	Verdicts.Flush();
+	return previous;
+}
+
+void FreeSnapshot(DirSnapshot* snapshot) {
+	if (snapshot) {
+		snapshot->Trie.Clear();
+		ExFreePoolWithTag(snapshot, DRIVER_TAG);
 	}
-	DirNamesCount = 0;
 }
 
 void DelProtectUnloadDriver(PDRIVER_OBJECT DriverObject) {
 	ClearAll();
 	PsSetCreateProcessNotifyRoutineEx(OnProcessNotify, TRUE);
+	FreeSnapshot(DirSnapshots.Shutdown());
+	Verdicts.Flush();
+	DriveMap.Shutdown();
 	UNICODE_STRING symLink = RTL_CONSTANT_STRING(L"\\??\\pathProtect");
 	IoDeleteSymbolicLink(&symLink);
 	IoDeleteDevice(DriverObject->DeviceObject);
@@ -285,51 +518,7 @@ NTSTATUS ConvertDosNameToNtName(_In_ PCWSTR dosName, _Out_ PUNICODE_STRING ntNam
 	if (dosName[2] != L'\\' || dosName[1] != L':')
 		return STATUS_INVALID_PARAMETER;
 
-	kstring symLink(L"\\??\\", PagedPool, DRIVER_TAG);
-
-	symLink.Append(dosName, 2);		// driver letter and colon
-
-	// prepare to open symbolic link
-
-	UNICODE_STRING symLinkFull;
-	symLink.GetUnicodeString(&symLinkFull);
-	OBJECT_ATTRIBUTES symLinkAttr;
-	InitializeObjectAttributes(&symLinkAttr, &symLinkFull, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr, nullptr);
-
-	HANDLE hSymLink = nullptr;
-	auto status = STATUS_SUCCESS;
-	do {
-		// open symbolic link
-		status = ZwOpenSymbolicLinkObject(&hSymLink, GENERIC_READ, &symLinkAttr);
-		if (!NT_SUCCESS(status))
-			break;
-
-		USHORT maxLen = 1024;	// arbitrary
-		ntName->Buffer = (WCHAR*)ExAllocatePool(PagedPool, maxLen);
-		if (!ntName->Buffer) {
-			status = STATUS_INSUFFICIENT_RESOURCES;
-			break;
-		}
-		ntName->MaximumLength = maxLen;
-		// read target of symbolic link
-		status = ZwQuerySymbolicLinkObject(hSymLink, ntName, nullptr);
-		if (!NT_SUCCESS(status))
-			break;
-	} while (false);
-
-	if (!NT_SUCCESS(status)) {
-		if (ntName->Buffer) {
-			ExFreePool(ntName->Buffer);
-			ntName->Buffer = nullptr;
-		}
-	}
-	else {
-		RtlAppendUnicodeToString(ntName, dosName + 2);	// directory
-	}
-	if (hSymLink)
-		ZwClose(hSymLink);
-
-	return status;
+	return DriveMap.Translate(dosName, ntName);
 }
 
 void OnProcessNotify(PEPROCESS Process, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO CreateInfo) {
@@ -343,8 +532,21 @@ void OnProcessNotify(PEPROCESS Process, HANDLE ProcessId, PPS_CREATE_NOTIFY_INFO
 		if (CreateInfo->FileOpenNameAvailable && CreateInfo->ImageFileName)
 		{
 			KdPrint(("ImageFilePath: %wZ\n", CreateInfo->ImageFileName));
-			AutoLock locker(DirNamesLock);
-			if (FindDirectory(CreateInfo->ImageFileName, true) >= 0) {
+			UNICODE_STRING imagePath = *CreateInfo->ImageFileName;
+			StripDosDevicesPrefix(&imagePath);
+
+			auto blocked = false;
+			SnapshotRef<DirSnapshot> snapshot(DirSnapshots);
+			if (snapshot) {
+				VerdictCache::Key key;
+				VerdictCache::MakeKey(&imagePath, key);
+				if (!Verdicts.Lookup(key, snapshot->Generation, blocked)) {
+					blocked = snapshot->Trie.MatchPrefix(&imagePath);
+					Verdicts.Insert(key, snapshot->Generation, blocked);
+				}
+			}
+
+			if (blocked) {
 				
 				KdPrint(("File not allowed to Execute: %ws\n", CreateInfo->ImageFileName->Buffer));
 				CreateInfo->CreationStatus = STATUS_ACCESS_DENIED;
@@ -5,17 +5,9 @@ kstring::kstring(const wchar_t* str, POOL_TYPE pool, ULONG tag) : kstring(str, 0
 }
 
 kstring::kstring(const wchar_t* str, ULONG count, POOL_TYPE pool, ULONG tag) : m_Pool(pool), m_Tag(tag) {
-	if (str) {
-		m_Len = count == 0 ? static_cast<ULONG>(wcslen(str)) : count;
-		m_Capacity = m_Len + 1;
-		m_str = Allocate(m_Capacity, str);
-		if (!m_str)
-			ExRaiseStatus(STATUS_NO_MEMORY);
-	}
-	else {
-		m_str = nullptr;
-		m_Len = m_Capacity = 0;
-	}
+	InitInline();
+	if (str)
+		Assign(str, count == 0 ? static_cast<ULONG>(wcslen(str)) : count);
 }
 
 kstring::~kstring() {
@@ -23,31 +15,29 @@ kstring::~kstring() {
 }
 
 void kstring::Release() {
-	if (m_str) {
+	if (!IsInline())
 		ExFreePoolWithTag(m_str, m_Tag);
-		m_str = nullptr;
-	}
+	InitInline();
 }
 
-kstring::kstring(kstring&& other) {
-	m_Len = other.m_Len;
-	m_str = other.m_str;
-	m_Pool = other.m_Pool;
-	other.m_str = nullptr;
-	other.m_Len = 0;
+void kstring::InitInline() {
+	m_str = m_Inline;
+	m_str[0] = L'\0';
+	m_Len = 0;
+	m_Capacity = InlineCapacity;
+}
+
+kstring::kstring(kstring&& other) : m_Pool(other.m_Pool), m_Tag(other.m_Tag) {
+	InitInline();
+	*this = static_cast<kstring&&>(other);
 }
 
 kstring& kstring::operator+=(const kstring& other) {
-	return Append(other);
+	return Append(other.m_str, other.m_Len);
 }
 
 kstring& kstring::operator+=(PCWSTR str) {
-	m_Len += static_cast<ULONG>(::wcslen(str));
-	auto newBuffer = Allocate(m_Len, m_str);
-	::wcscat_s(newBuffer, m_Len + 1, str);
-	Release();
-	m_str = newBuffer;
-	return *this;
+	return Append(str);
 }
 
 bool kstring::operator==(const kstring& other) {
@@ -66,42 +56,39 @@ wchar_t& kstring::GetAt(size_t index) {
 
 kstring& kstring::operator=(kstring&& other) {
 	if (this != &other) {
-		if (m_str)
-			ExFreePoolWithTag(m_str, m_Tag);
-		m_Len = other.m_Len;
-		m_str = other.m_str;
-		other.m_str = nullptr;
-		other.m_Len = 0;
+		Release();
+		m_Pool = other.m_Pool;
+		m_Tag = other.m_Tag;
+		if (other.IsInline()) {
+			Assign(other.m_str, other.m_Len);
+		}
+		else {
+			// steal the pool buffer
+			m_str = other.m_str;
+			m_Len = other.m_Len;
+			m_Capacity = other.m_Capacity;
+		}
+		other.InitInline();
 	}
 	return *this;
 }
 
 kstring::kstring(PCUNICODE_STRING str, POOL_TYPE pool, ULONG tag) : m_Pool(pool), m_Tag(tag) {
-	m_Len = str->Length / sizeof(WCHAR);
-	m_str = Allocate(m_Len, str->Buffer);
+	InitInline();
+	Assign(str->Buffer, str->Length / sizeof(WCHAR));
 }
 
-kstring::kstring(const kstring& other) : m_Len(other.m_Len) {
-	m_Pool = other.m_Pool;
-	m_Tag = other.m_Tag;
-	if (m_Len > 0) {
-		m_str = Allocate(m_Len, other.m_str);
-	}
-	else {
-		m_str = nullptr;
-	}
+kstring::kstring(const kstring& other) : m_Pool(other.m_Pool), m_Tag(other.m_Tag) {
+	InitInline();
+	Assign(other.m_str, other.m_Len);
 }
 
 kstring& kstring::operator=(const kstring& other) {
 	if (this != &other) {
-		if (m_str)
-			ExFreePoolWithTag(m_str, m_Tag);
-		m_Len = other.m_Len;
+		Release();
 		m_Tag = other.m_Tag;
 		m_Pool = other.m_Pool;
-		if (other.m_str) {
-			m_str = Allocate(m_Len, other.m_str);
-		}
+		Assign(other.m_str, other.m_Len);
 	}
 	return *this;
 }
@@ -111,20 +98,54 @@ UNICODE_STRING* kstring::GetUnicodeString(PUNICODE_STRING pUnicodeString) {
 	return pUnicodeString;
 }
 
-wchar_t* kstring::Allocate(size_t chars, const wchar_t* src) {
-	auto str = static_cast<wchar_t*>(ExAllocatePoolWithTag(m_Pool, sizeof(WCHAR) * (chars + 1), m_Tag));
-	if (!str) {
-		KdPrint(("Failed to allocate kstring of length %d chars\n", chars));
-		return nullptr;
+// expects an empty string
+void kstring::Assign(const wchar_t* str, ULONG len) {
+	if (len + 1 > m_Capacity) {
+		m_str = Allocate(len + 1);
+		if (!m_str) {
+			InitInline();
+			ExRaiseStatus(STATUS_NO_MEMORY);
+		}
+		m_Capacity = len + 1;
 	}
-	if (src) {
-		wcscpy_s(str, chars + 1, src);
+	RtlCopyMemory(m_str, str, len * sizeof(WCHAR));
+	m_str[len] = L'\0';
+	m_Len = len;
+}
+
+wchar_t* kstring::Allocate(ULONG capacity) {
+	auto str = static_cast<wchar_t*>(ExAllocatePoolWithTag(m_Pool, sizeof(WCHAR) * capacity, m_Tag));
+	if (!str) {
+		KdPrint(("Failed to allocate kstring of length %u chars\n", capacity - 1));
 	}
 	return str;
 }
 
+ULONG kstring::GrowCapacity(ULONG required) const {
+	// doubling keeps a run of appends at amortized O(1) allocations
+	auto capacity = m_Capacity * 2;
+	return capacity < required ? required : capacity;
+}
+
+bool kstring::Reserve(ULONG chars) {
+	if (chars + 1 <= m_Capacity)
+		return true;
+
+	auto capacity = GrowCapacity(chars + 1);
+	auto newBuffer = Allocate(capacity);
+	if (!newBuffer)
+		return false;
+
+	RtlCopyMemory(newBuffer, m_str, (m_Len + 1) * sizeof(WCHAR));
+	if (!IsInline())
+		ExFreePoolWithTag(m_str, m_Tag);
+	m_str = newBuffer;
+	m_Capacity = capacity;
+	return true;
+}
+
 kstring kstring::ToLower() const {
-	kstring temp(m_str);
+	kstring temp(*this);
 	::_wcslwr(temp.m_str);
 	return temp;
 }
@@ -148,17 +169,26 @@ kstring& kstring::Truncate(ULONG count) {
 kstring & kstring::Append(PCWSTR str, ULONG len) {
 	if (len == 0)
 		len = (ULONG)::wcslen(str);
+
 	auto newBuffer = m_str;
-	auto newAlloc = false;
-	m_Len += len;
-	if (m_Len + 1 > m_Capacity) {
-		newBuffer = Allocate(m_Capacity = m_Len + 8, m_str);
-		newAlloc = true;
+	auto capacity = m_Capacity;
+	if (m_Len + len + 1 > m_Capacity) {
+		capacity = GrowCapacity(m_Len + len + 1);
+		newBuffer = Allocate(capacity);
+		if (!newBuffer)
+			ExRaiseStatus(STATUS_NO_MEMORY);
+		RtlCopyMemory(newBuffer, m_str, m_Len * sizeof(WCHAR));
 	}
-	::wcsncat_s(newBuffer, m_Capacity, str, len);
-	if (newAlloc) {
-		Release();
+
+	// str may point into our own buffer, so the old one is freed only after the copy
+	RtlMoveMemory(newBuffer + m_Len, str, len * sizeof(WCHAR));
+	m_Len += len;
+	newBuffer[m_Len] = L'\0';
+	if (newBuffer != m_str) {
+		if (!IsInline())
+			ExFreePoolWithTag(m_str, m_Tag);
 		m_str = newBuffer;
+		m_Capacity = capacity;
 	}
 	return *this;
 }
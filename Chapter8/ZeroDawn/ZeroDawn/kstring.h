@@ -1,9 +1,15 @@
 #pragma once
 
 #include <ntddk.h>
+#include "kstring_view.h"
 
+// Short strings (drive prefixes, single path components) are kept in an
+// inline buffer; longer ones go to pool memory that grows geometrically.
 class kstring final {
 public:
+	// in characters, including the NULL terminator
+	static const ULONG InlineCapacity = 16;
+
 	explicit kstring(const wchar_t* str = nullptr, POOL_TYPE pool = PagedPool, ULONG tag = 0);
 	kstring(const wchar_t* str, ULONG count, POOL_TYPE pool = PagedPool, ULONG tag = 0);
 	kstring(const kstring& other);
@@ -27,10 +33,21 @@ public:
 		return m_str;
 	}
 
+	kstring_view View() const {
+		return kstring_view(m_str, m_Len);
+	}
+
 	ULONG Length() const {
 		return m_Len;
 	}
 
+	// characters that fit without reallocating
+	ULONG Capacity() const {
+		return m_Capacity - 1;
+	}
+
+	bool Reserve(ULONG chars);
+
 	kstring ToLower() const;
 	kstring& ToLower();
 	kstring& Truncate(ULONG length);
@@ -53,11 +70,19 @@ public:
 	UNICODE_STRING* GetUnicodeString(PUNICODE_STRING);
 
 private:
-	wchar_t* Allocate(size_t chars, const wchar_t* src = nullptr);
+	void InitInline();
+	void Assign(const wchar_t* str, ULONG len);
+	wchar_t* Allocate(ULONG capacity);
+	ULONG GrowCapacity(ULONG required) const;
+
+	bool IsInline() const {
+		return m_str == m_Inline;
+	}
 
 private:
 	wchar_t* m_str;
 	ULONG m_Len, m_Capacity;
 	POOL_TYPE m_Pool;
 	ULONG m_Tag;
+	wchar_t m_Inline[InlineCapacity];
 };
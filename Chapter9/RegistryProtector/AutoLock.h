@@ -15,4 +15,22 @@ public:
 	}
 private:
 	TLock& _lock;
+};
+
+// acquires a lock that supports shared ownership (e.g. ExecutiveResource) for reading
+template<typename TLock>
+struct AutoSharedLock
+{
+public:
+	AutoSharedLock(TLock& lock) : _lock(lock)
+	{
+		lock.LockShared();
+	}
+
+	~AutoSharedLock()
+	{
+		_lock.UnlockShared();
+	}
+private:
+	TLock& _lock;
 };
\ No newline at end of file
@@ -0,0 +1,37 @@
+#include "pch.h"
+#include "ExecutiveResource.h"
+
+void ExecutiveResource::Init()
+{
+	ExInitializeResourceLite(&_res);
+}
+
+
+void ExecutiveResource::Delete()
+{
+	ExDeleteResourceLite(&_res);
+}
+
+
+void ExecutiveResource::Lock()
+{
+	ExEnterCriticalRegionAndAcquireResourceExclusive(&_res);
+}
+
+
+void ExecutiveResource::Unlock()
+{
+	ExReleaseResourceAndLeaveCriticalRegion(&_res);
+}
+
+
+void ExecutiveResource::LockShared()
+{
+	ExEnterCriticalRegionAndAcquireResourceShared(&_res);
+}
+
+
+void ExecutiveResource::UnlockShared()
+{
+	ExReleaseResourceAndLeaveCriticalRegion(&_res);
+}
\ No newline at end of file
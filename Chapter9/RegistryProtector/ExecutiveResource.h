@@ -0,0 +1,23 @@
+#pragma once
+#include "pch.h"
+
+// Reader/writer lock over an ERESOURCE: any number of shared owners or
+// one exclusive owner. Acquisition enters a critical region, so normal
+// kernel APCs can't suspend an owner. Call at IRQL <= APC_LEVEL.
+class ExecutiveResource
+{
+public:
+
+	void Init();
+	void Delete();
+
+	// exclusive
+	void Lock();
+	void Unlock();
+
+	void LockShared();
+	void UnlockShared();
+
+private:
+	ERESOURCE _res;
+};
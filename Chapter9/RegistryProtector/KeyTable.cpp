@@ -0,0 +1,199 @@
+#include "pch.h"
+#include "KeyTable.h"
+#include "UnicodeFold.h"
+
+void KeyTable::Init(POOL_TYPE pool, ULONG tag)
+{
+	m_Entries = nullptr;
+	m_Count = m_Capacity = 0;
+	m_Index = nullptr;
+	m_IndexCapacity = 0;
+	m_Names = nullptr;
+	m_NamesUsed = m_NamesCapacity = m_NamesDead = 0;
+	m_Pool = pool;
+	m_Tag = tag;
+}
+
+void KeyTable::Clear()
+{
+	if (m_Entries)
+		ExFreePoolWithTag(m_Entries, m_Tag);
+	if (m_Index)
+		ExFreePoolWithTag(m_Index, m_Tag);
+	if (m_Names)
+		ExFreePoolWithTag(m_Names, m_Tag);
+
+	Init(m_Pool, m_Tag);
+}
+
+SIZE_T KeyTable::Bytes() const
+{
+	return m_Capacity * sizeof(KeyEntry) + m_IndexCapacity * sizeof(ULONG) + m_NamesCapacity * sizeof(WCHAR);
+}
+
+SIZE_T KeyTable::InsertCost(ULONG nameLength) const
+{
+	// mirrors the growth in Reserve
+	SIZE_T cost = 0;
+	if (m_Count + 1 > m_Capacity)
+		cost += (m_Capacity ? m_Capacity : InitialEntries) * sizeof(KeyEntry);
+	if ((m_Count + 1) * 2 > m_IndexCapacity)
+		cost += (m_IndexCapacity ? m_IndexCapacity : InitialIndex) * sizeof(ULONG);
+	if (m_NamesUsed + nameLength > m_NamesCapacity)
+	{
+		auto capacity = m_NamesCapacity ? m_NamesCapacity * 2 : InitialNames;
+		if (capacity < m_NamesUsed + nameLength)
+			capacity = m_NamesUsed + nameLength;
+		cost += (capacity - m_NamesCapacity) * sizeof(WCHAR);
+	}
+	return cost;
+}
+
+NTSTATUS KeyTable::Insert(const kstring_view& name)
+{
+	auto hash = HashName(name);
+	if (m_Count > 0 && *FindSlot(name, hash) != 0)
+		return STATUS_OBJECT_NAME_COLLISION;
+
+	if (!Reserve(m_Count + 1, name.Length()))
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	auto& entry = m_Entries[m_Count];
+	entry.Hash = hash;
+	entry.Offset = m_NamesUsed;
+	entry.Length = name.Length();
+	RtlCopyMemory(m_Names + m_NamesUsed, name.Data(), name.Length() * sizeof(WCHAR));
+	m_NamesUsed += name.Length();
+	IndexEntry(m_Count++);
+	return STATUS_SUCCESS;
+}
+
+ULONG KeyTable::Find(const kstring_view& name) const
+{
+	if (m_Count == 0)
+		return NotFound;
+
+	auto slot = *FindSlot(name, HashName(name));
+	return slot ? slot - 1 : NotFound;
+}
+
+void KeyTable::Remove(ULONG index)
+{
+	NT_ASSERT(index < m_Count);
+
+	// keep insertion order (and with it pool order) by closing the gap;
+	// removal is an administrative operation, lookups are what must be fast
+	m_NamesDead += m_Entries[index].Length;
+	RtlMoveMemory(m_Entries + index, m_Entries + index + 1, (m_Count - index - 1) * sizeof(KeyEntry));
+	m_Count--;
+
+	if (m_NamesDead > m_NamesUsed / 2)
+		CompactNames();
+
+	RtlZeroMemory(m_Index, m_IndexCapacity * sizeof(ULONG));
+	for (ULONG i = 0; i < m_Count; i++)
+		IndexEntry(i);
+}
+
+ULONG KeyTable::HashName(const kstring_view& name)
+{
+	return FoldHash(name.Data(), name.Length());
+}
+
+bool KeyTable::Reserve(ULONG entries, ULONG nameChars)
+{
+	if (entries > m_Capacity)
+	{
+		auto capacity = m_Capacity ? m_Capacity * 2 : InitialEntries;
+		auto newEntries = static_cast<KeyEntry*>(ExAllocatePoolWithTag(m_Pool, capacity * sizeof(KeyEntry), m_Tag));
+		if (!newEntries)
+			return false;
+
+		if (m_Entries)
+		{
+			RtlCopyMemory(newEntries, m_Entries, m_Count * sizeof(KeyEntry));
+			ExFreePoolWithTag(m_Entries, m_Tag);
+		}
+		m_Entries = newEntries;
+		m_Capacity = capacity;
+	}
+
+	if (entries * 2 > m_IndexCapacity && !GrowIndex(m_IndexCapacity ? m_IndexCapacity * 2 : InitialIndex))
+		return false;
+
+	if (m_NamesUsed + nameChars > m_NamesCapacity)
+	{
+		auto capacity = m_NamesCapacity ? m_NamesCapacity * 2 : InitialNames;
+		if (capacity < m_NamesUsed + nameChars)
+			capacity = m_NamesUsed + nameChars;
+		auto names = static_cast<WCHAR*>(ExAllocatePoolWithTag(m_Pool, capacity * sizeof(WCHAR), m_Tag));
+		if (!names)
+			return false;
+
+		if (m_Names)
+		{
+			RtlCopyMemory(names, m_Names, m_NamesUsed * sizeof(WCHAR));
+			ExFreePoolWithTag(m_Names, m_Tag);
+		}
+		m_Names = names;
+		m_NamesCapacity = capacity;
+	}
+	return true;
+}
+
+bool KeyTable::GrowIndex(ULONG capacity)
+{
+	auto index = static_cast<ULONG*>(ExAllocatePoolWithTag(m_Pool, capacity * sizeof(ULONG), m_Tag));
+	if (!index)
+		return false;
+
+	if (m_Index)
+		ExFreePoolWithTag(m_Index, m_Tag);
+	m_Index = index;
+	m_IndexCapacity = capacity;
+
+	RtlZeroMemory(m_Index, capacity * sizeof(ULONG));
+	for (ULONG i = 0; i < m_Count; i++)
+		IndexEntry(i);
+	return true;
+}
+
+void KeyTable::IndexEntry(ULONG index)
+{
+	auto mask = m_IndexCapacity - 1;
+	auto slot = m_Entries[index].Hash & mask;
+	while (m_Index[slot])
+		slot = (slot + 1) & mask;
+	m_Index[slot] = index + 1;
+}
+
+// the slot holding name, or the free slot where the probe for it ends
+ULONG* KeyTable::FindSlot(const kstring_view& name, ULONG hash) const
+{
+	auto mask = m_IndexCapacity - 1;
+	for (auto slot = hash & mask;; slot = (slot + 1) & mask)
+	{
+		auto& value = m_Index[slot];
+		if (value == 0)
+			return &value;
+
+		auto& entry = m_Entries[value - 1];
+		if (entry.Hash == hash && name.EqualsNoCase(kstring_view(m_Names + entry.Offset, entry.Length)))
+			return &value;
+	}
+}
+
+// entries are in pool order, so the live names slide down in place
+void KeyTable::CompactNames()
+{
+	ULONG used = 0;
+	for (ULONG i = 0; i < m_Count; i++)
+	{
+		auto& entry = m_Entries[i];
+		RtlMoveMemory(m_Names + used, m_Names + entry.Offset, entry.Length * sizeof(WCHAR));
+		entry.Offset = used;
+		used += entry.Length;
+	}
+	m_NamesUsed = used;
+	m_NamesDead = 0;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <ntddk.h>
+#include "kstring_view.h"
+
+// One protected key. The name itself lives in the table's string pool.
+struct KeyEntry
+{
+	ULONG Hash;		// of the case-folded name
+	ULONG Offset;	// into the string pool, in characters
+	ULONG Length;	// in characters, no terminator is stored
+};
+
+// Protected keys: a dense array of fixed-size entries in insertion order,
+// their names packed back to back in one pool buffer, and an open-addressed
+// index of entry numbers keyed by the folded name hash.
+// Not synchronized; callers serialize access.
+class KeyTable final
+{
+public:
+	static const ULONG NotFound = static_cast<ULONG>(-1);
+
+	void Init(POOL_TYPE pool = PagedPool, ULONG tag = 0);
+	void Clear();
+
+	// STATUS_OBJECT_NAME_COLLISION if the name is already stored
+	NTSTATUS Insert(const kstring_view& name);
+	// the entry number of name, or NotFound
+	ULONG Find(const kstring_view& name) const;
+	void Remove(ULONG index);
+
+	kstring_view Name(ULONG index) const
+	{
+		NT_ASSERT(index < m_Count);
+		return kstring_view(m_Names + m_Entries[index].Offset, m_Entries[index].Length);
+	}
+
+	ULONG Count() const
+	{
+		return m_Count;
+	}
+
+	// pool memory held by the entries, the index and the string pool
+	SIZE_T Bytes() const;
+	// how much Bytes() grows if a name of nameLength characters is inserted
+	SIZE_T InsertCost(ULONG nameLength) const;
+
+	static ULONG HashName(const kstring_view& name);
+
+private:
+	static const ULONG InitialEntries = 16;
+	static const ULONG InitialIndex = 32;
+	static const ULONG InitialNames = 1024;
+
+	bool Reserve(ULONG entries, ULONG nameChars);
+	bool GrowIndex(ULONG capacity);
+	void IndexEntry(ULONG index);
+	ULONG* FindSlot(const kstring_view& name, ULONG hash) const;
+	void CompactNames();
+
+private:
+	KeyEntry* m_Entries;
+	ULONG m_Count;
+	ULONG m_Capacity;
+	ULONG* m_Index;			// entry number + 1, zero for a free slot
+	ULONG m_IndexCapacity;	// power of two, at least twice m_Count
+	WCHAR* m_Names;
+	ULONG m_NamesUsed;		// characters, including those of removed entries
+	ULONG m_NamesCapacity;
+	ULONG m_NamesDead;		// characters of removed entries not reclaimed yet
+	POOL_TYPE m_Pool;
+	ULONG m_Tag;
+};
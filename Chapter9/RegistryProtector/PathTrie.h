@@ -0,0 +1,69 @@
+#pragma once
+
+#include <ntddk.h>
+
+// A node holds one upper-cased key path component ("REGISTRY", "MACHINE", ...).
+// Children live in an open-addressed table keyed by the component hash,
+// so descending one level costs O(component length).
+struct PathTrieNode {
+	PathTrieNode* Parent;
+	PathTrieNode** Children;
+	ULONG ChildCapacity;
+	ULONG ChildCount;
+	ULONG Hash;
+	USHORT Length;
+	bool Terminal;
+	WCHAR Name[1];
+};
+
+// receives each stored path during PathTrie::Enumerate; return false to stop
+typedef bool (*PathTrieVisitor)(PCWCH path, USHORT length, PVOID context);
+
+// Component-aware, case-insensitive prefix trie of registry key paths.
+// Not synchronized; callers serialize writers and readers.
+class PathTrie final {
+public:
+	void Init(POOL_TYPE pool = PagedPool, ULONG tag = 0);
+	void Clear();
+
+	NTSTATUS Insert(PCUNICODE_STRING path);
+	bool Remove(PCUNICODE_STRING path);
+
+	// true if a stored directory is a proper prefix of path, i.e. path
+	// names a file somewhere below one of the stored directories
+	bool MatchPrefix(PCUNICODE_STRING path) const;
+
+	// true if path itself or one of its ancestors is stored
+	bool MatchSubtree(PCUNICODE_STRING path) const;
+
+	// calls visitor for the stored paths (folded, with a leading backslash)
+	// after the first skip of them. The order is stable while the trie is
+	// unchanged. buffer holds the path during each call and must fit the
+	// longest one.
+	void Enumerate(ULONG skip, PWCH buffer, USHORT bufferLength, PathTrieVisitor visitor, PVOID context) const;
+
+	ULONG Count() const {
+		return m_Count;
+	}
+
+	// pool memory held by nodes and child tables
+	SIZE_T Bytes() const {
+		return m_Bytes;
+	}
+
+private:
+	PathTrieNode* FindChild(const PathTrieNode* node, PCWCH name, USHORT len, ULONG hash) const;
+	PathTrieNode* AddChild(PathTrieNode* node, PCWCH name, USHORT len, ULONG hash);
+	void RemoveChild(PathTrieNode* node, PathTrieNode* child);
+	static ULONG ChildSlot(const PathTrieNode* node, const PathTrieNode* child);
+	bool GrowChildren(PathTrieNode* node);
+	void Prune(PathTrieNode* node);
+	void FreeNode(PathTrieNode* node);
+
+private:
+	PathTrieNode m_Root;
+	ULONG m_Count;
+	SIZE_T m_Bytes;
+	POOL_TYPE m_Pool;
+	ULONG m_Tag;
+};
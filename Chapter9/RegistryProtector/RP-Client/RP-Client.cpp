@@ -11,11 +11,150 @@ int Error(const char* text) {
 }
 
 int PrintUsage() {
-	printf("Usage: RegistryProtectorClient <option> [directory]\n");
-	printf("\tOption: add, remove or clear\n");
+	printf("Usage: RegistryProtectorClient <option> [key]\n");
+	printf("\tOption: add, remove, addtree, removetree, clear, stats, usage or limit <bytes>\n");
+	printf("\t        import <file> or export <file>\n");
+	printf("\tRule files hold one key per line; \"tree <key>\" lines protect a whole subtree\n");
 	return 0;
 }
 
+// rules are sent and received in chunks of this size
+const DWORD RuleBufferSize = 1 << 20;
+const wchar_t TreePrefix[] = L"tree ";
+
+bool SendRules(HANDLE hDevice, BYTE* buffer, DWORD size, ULONG& total) {
+	RegBulkResult result{};
+	DWORD returned;
+	if (!::DeviceIoControl(hDevice, IOCTL_REGKEY_PROTECT_ADD_BULK, buffer, size, &result, sizeof(result), &returned, nullptr))
+		return false;
+
+	total += result.Applied;
+	if (result.Status != 0) {
+		printf("Import stopped after %u rules of this batch (status 0x%08X)\n", result.Applied, (ULONG)result.Status);
+		return false;
+	}
+	return true;
+}
+
+// sends the rules in file to the driver, a chunk at a time; empty lines and
+// lines starting with # are skipped
+bool ImportRules(HANDLE hDevice, const wchar_t* file) {
+	FILE* fp;
+	if (::_wfopen_s(&fp, file, L"rt, ccs=UTF-8") != 0) {
+		printf("Failed to open %ws\n", file);
+		return false;
+	}
+
+	auto buffer = (BYTE*)::malloc(RuleBufferSize);
+	if (!buffer) {
+		::fclose(fp);
+		return false;
+	}
+
+	auto header = (RegRuleListHeader*)buffer;
+	DWORD size = sizeof(RegRuleListHeader);
+	header->Count = 0;
+	ULONG total = 0, lines = 0;
+	bool success = true;
+	wchar_t line[_countof(TreePrefix) + MaxRegNameSize + 2];
+	while (success && ::fgetws(line, _countof(line), fp)) {
+		auto len = ::wcslen(line);
+		while (len > 0 && (line[len - 1] == L'\n' || line[len - 1] == L'\r' || line[len - 1] == L' '))
+			line[--len] = L'\0';
+		if (len == 0 || line[0] == L'#')
+			continue;
+
+		auto name = line;
+		USHORT flags = 0;
+		if (::_wcsnicmp(line, TreePrefix, _countof(TreePrefix) - 1) == 0) {
+			name += _countof(TreePrefix) - 1;
+			len -= _countof(TreePrefix) - 1;
+			flags = RegRuleSubtree;
+		}
+		if (len == 0 || len >= MaxRegNameSize) {
+			printf("Skipping invalid line: %ws\n", line);
+			continue;
+		}
+
+		auto bytes = (USHORT)(len * sizeof(WCHAR));
+		if (size + FIELD_OFFSET(RegRuleEntry, Name) + bytes > RuleBufferSize) {
+			success = SendRules(hDevice, buffer, size, total);
+			size = sizeof(RegRuleListHeader);
+			header->Count = 0;
+		}
+		auto entry = (RegRuleEntry*)(buffer + size);
+		entry->Flags = flags;
+		entry->Length = bytes;
+		::memcpy(entry->Name, name, bytes);
+		size += FIELD_OFFSET(RegRuleEntry, Name) + bytes;
+		header->Count++;
+		lines++;
+	}
+	if (success && header->Count > 0)
+		success = SendRules(hDevice, buffer, size, total);
+
+	::fclose(fp);
+	::free(buffer);
+	printf("Imported %u of %u rules\n", total, lines);
+	return success;
+}
+
+// writes the driver's rules to file in the format ImportRules reads
+bool ExportRules(HANDLE hDevice, const wchar_t* file) {
+	auto buffer = (BYTE*)::malloc(RuleBufferSize);
+	if (!buffer)
+		return false;
+
+	FILE* fp = nullptr;
+	bool success = false;
+	// start over if the rules change between chunks, a few times at most
+	for (int attempt = 0; attempt < 3 && !success; attempt++) {
+		if (fp)
+			::fclose(fp);
+		if (::_wfopen_s(&fp, file, L"wt, ccs=UTF-8") != 0) {
+			printf("Failed to create %ws\n", file);
+			break;
+		}
+
+		ULONG cursor = 0, generation = 0, count = 0;
+		success = true;
+		do {
+			*(ULONG*)buffer = cursor;
+			DWORD returned;
+			if (!::DeviceIoControl(hDevice, IOCTL_REGKEY_PROTECT_LIST, buffer, sizeof(cursor), buffer, RuleBufferSize, &returned, nullptr)) {
+				success = false;
+				attempt = 3;
+				break;
+			}
+
+			auto header = (RegRuleListHeader*)buffer;
+			if (cursor != 0 && header->Generation != generation) {
+				success = false;
+				break;
+			}
+			generation = header->Generation;
+
+			auto data = (BYTE*)(header + 1);
+			for (ULONG i = 0; i < header->Count; i++) {
+				auto entry = (RegRuleEntry*)data;
+				::fwprintf(fp, L"%ws%.*ws\n", (entry->Flags & RegRuleSubtree) ? TreePrefix : L"",
+					(int)(entry->Length / sizeof(WCHAR)), entry->Name);
+				data += FIELD_OFFSET(RegRuleEntry, Name) + entry->Length;
+			}
+			count += header->Count;
+			cursor = header->NextCursor;
+		} while (cursor != RegRuleListEnd);
+
+		if (success)
+			printf("Exported %u rules\n", count);
+	}
+
+	if (fp)
+		::fclose(fp);
+	::free(buffer);
+	return success;
+}
+
 int wmain(int argc, const wchar_t* argv[]) {
 	if (argc < 2) {
 		return PrintUsage();
@@ -43,16 +182,83 @@ int wmain(int argc, const wchar_t* argv[]) {
 		success = ::DeviceIoControl(hDevice, IOCTL_REGKEY_PROTECT_REMOVE, (PVOID)argv[2], ((DWORD)::wcslen(argv[2]) + 1) * sizeof(WCHAR), nullptr, 0, &returned, nullptr);
 	}
 
+	else if (::_wcsicmp(argv[1], L"addtree") == 0) {
+		if (argc < 3)
+			return PrintUsage();
+
+		success = ::DeviceIoControl(hDevice, IOCTL_REGKEY_PROTECT_ADD_TREE, (PVOID)argv[2], ((DWORD)::wcslen(argv[2]) + 1) * sizeof(WCHAR), nullptr, 0, &returned, nullptr);
+	}
+
+	else if (::_wcsicmp(argv[1], L"removetree") == 0) {
+		if (argc < 3)
+			return PrintUsage();
+
+		success = ::DeviceIoControl(hDevice, IOCTL_REGKEY_PROTECT_REMOVE_TREE, (PVOID)argv[2], ((DWORD)::wcslen(argv[2]) + 1) * sizeof(WCHAR), nullptr, 0, &returned, nullptr);
+	}
+
 	else if (::_wcsicmp(argv[1], L"clear") == 0) {
 
 		success = ::DeviceIoControl(hDevice, IOCTL_REGKEY_PROTECT_CLEAR, nullptr, 0, nullptr, 0, &returned, nullptr);
 	}
 
+	else if (::_wcsicmp(argv[1], L"stats") == 0) {
+		RegProtectStats stats;
+		success = ::DeviceIoControl(hDevice, IOCTL_REGKEY_PROTECT_GET_STATS, nullptr, 0, &stats, sizeof(stats), &returned, nullptr);
+		if (success) {
+			const char* names[] = {
+				"DeleteKey", "SetValue", "DeleteValue", "SetInformation", "RenameKey",
+				"CreateKey", "ReplaceKey", "RestoreKey", "SetSecurity"
+			};
+			static_assert(_countof(names) == (int)RegOperation::Count, "operation names out of sync");
+			printf("Skipped (non-mutating): %u\n", stats.Skipped);
+			for (int i = 0; i < (int)RegOperation::Count; i++)
+				printf("%-16s checked: %10u blocked: %10u\n", names[i], stats.Checked[i], stats.Blocked[i]);
+
+			auto lookups = stats.CacheHits + stats.CacheMisses;
+			printf("Verdict cache hits: %u misses: %u (%.1f%%)\n", stats.CacheHits, stats.CacheMisses,
+				lookups ? 100.0 * stats.CacheHits / lookups : 0.0);
+		}
+	}
+
+	else if (::_wcsicmp(argv[1], L"usage") == 0) {
+		RegProtectUsage usage;
+		success = ::DeviceIoControl(hDevice, IOCTL_REGKEY_PROTECT_GET_USAGE, nullptr, 0, &usage, sizeof(usage), &returned, nullptr);
+		if (success) {
+			printf("Keys: %u Subtrees: %u\n", usage.Keys, usage.Subtrees);
+			printf("Memory: %llu of %llu bytes\n", usage.Bytes, usage.Limit);
+		}
+	}
+
+	else if (::_wcsicmp(argv[1], L"limit") == 0) {
+		if (argc < 3)
+			return PrintUsage();
+
+		ULONG limit = ::wcstoul(argv[2], nullptr, 0);
+		success = ::DeviceIoControl(hDevice, IOCTL_REGKEY_PROTECT_SET_LIMIT, &limit, sizeof(limit), nullptr, 0, &returned, nullptr);
+	}
+
+	else if (::_wcsicmp(argv[1], L"import") == 0) {
+		if (argc < 3)
+			return PrintUsage();
+
+		success = ImportRules(hDevice, argv[2]);
+	}
+
+	else if (::_wcsicmp(argv[1], L"export") == 0) {
+		if (argc < 3)
+			return PrintUsage();
+
+		success = ExportRules(hDevice, argv[2]);
+	}
+
 	else {
 		badOption = true;
 		printf("Unknown option.\n");
 	}
 
+	// e.g. ERROR_NOT_ENOUGH_QUOTA when an add would go past the memory limit
+	if (!badOption && !success)
+		Error("Operation failed");
 
 	::CloseHandle(hDevice);
 
@@ -4,13 +4,79 @@
 #include "AutoLock.h"
 #include "RegistryProtector.h"
 #include "RegistryProtectorCommon.h"
+#include "kstring_view.h"
 
 // PROTOTYPES
 DRIVER_UNLOAD DriverUnload;
 DRIVER_DISPATCH DriverCreateClose, DriverDeviceControl;
-void PushItem(LIST_ENTRY* entry);
+NTSTATUS PushItem(const kstring_view& keyName);
 
 NTSTATUS OnRegistryNotify(PVOID context, PVOID arg1, PVOID arg2);
+bool IsKeyProtected(PCUNICODE_STRING keyName);
+void RulesChanged();
+SIZE_T RuleBytes();
+NTSTATUS AddKey(const kstring_view& keyName);
+NTSTATUS AddSubtree(PCUNICODE_STRING keyName);
+NTSTATUS ListRules(PVOID buffer, ULONG inputLength, ULONG outputLength, ULONG* written);
+NTSTATUS AddRules(PVOID buffer, ULONG size, ULONG* applied, NTSTATUS* addStatus);
+bool IsCreateBlocked(PREG_CREATE_KEY_INFORMATION info);
+bool KeyExists(PUNICODE_STRING keyName);
+
+// The mutating operations, and how to get at the key each one targets.
+// Every class not listed here leaves the callback before any name query.
+enum class KeyTarget
+{
+	Object,			// the info structure starts with the key object
+	CreateParent,	// REG_CREATE_KEY_INFORMATION: the key the new one is created under
+	Invalidate		// a post notification that only drops the cached verdicts
+};
+
+struct MonitoredClass
+{
+	REG_NOTIFY_CLASS Class;
+	RegOperation Operation;
+	KeyTarget Target;
+	ULONG ContextOffset;	// of the ObjectContext member, zero if the verdict isn't cached
+};
+
+const MonitoredClass MonitoredClasses[] =
+{
+	{ RegNtPreDeleteKey,			RegOperation::DeleteKey,		KeyTarget::Object,			FIELD_OFFSET(REG_DELETE_KEY_INFORMATION, ObjectContext) },
+	{ RegNtPreSetValueKey,			RegOperation::SetValue,			KeyTarget::Object,			FIELD_OFFSET(REG_SET_VALUE_KEY_INFORMATION, ObjectContext) },
+	{ RegNtPreDeleteValueKey,		RegOperation::DeleteValue,		KeyTarget::Object,			FIELD_OFFSET(REG_DELETE_VALUE_KEY_INFORMATION, ObjectContext) },
+	{ RegNtPreSetInformationKey,	RegOperation::SetInformation,	KeyTarget::Object,			FIELD_OFFSET(REG_SET_INFORMATION_KEY_INFORMATION, ObjectContext) },
+	{ RegNtPreRenameKey,			RegOperation::RenameKey,		KeyTarget::Object,			FIELD_OFFSET(REG_RENAME_KEY_INFORMATION, ObjectContext) },
+	{ RegNtPostRenameKey,			RegOperation::RenameKey,		KeyTarget::Invalidate,		0 },
+	{ RegNtPreCreateKeyEx,			RegOperation::CreateKey,		KeyTarget::CreateParent,	0 },
+	{ RegNtPreReplaceKey,			RegOperation::ReplaceKey,		KeyTarget::Object,			FIELD_OFFSET(REG_REPLACE_KEY_INFORMATION, ObjectContext) },
+	{ RegNtPreRestoreKey,			RegOperation::RestoreKey,		KeyTarget::Object,			FIELD_OFFSET(REG_RESTORE_KEY_INFORMATION, ObjectContext) },
+	{ RegNtPreSetKeySecurity,		RegOperation::SetSecurity,		KeyTarget::Object,			FIELD_OFFSET(REG_SET_KEY_SECURITY_INFORMATION, ObjectContext) },
+};
+
+// A key object's verdict is kept in the object context itself (no allocation):
+// bit 0 marks a verdict, bit 1 is set when blocked and the rest is the verdict
+// epoch it was computed under. A stale epoch counts as a miss.
+const ULONG_PTR VerdictValid = 1;
+const ULONG_PTR VerdictBlocked = 2;
+const int VerdictEpochShift = 2;
+
+inline PVOID MakeVerdict(LONG epoch, bool blocked)
+{
+	return (PVOID)(((ULONG_PTR)(ULONG)epoch << VerdictEpochShift) | (blocked ? VerdictBlocked : 0) | VerdictValid);
+}
+
+inline bool VerdictMatches(PVOID context, LONG epoch)
+{
+	auto verdict = (ULONG_PTR)context;
+	return (verdict & VerdictValid) &&
+		(verdict >> VerdictEpochShift) == (((ULONG_PTR)(ULONG)epoch << VerdictEpochShift) >> VerdictEpochShift);
+}
+
+// full key names up to this many characters are built on the stack for creates
+const ULONG CreateNameStackLength = 256;
+
+// REG_NOTIFY_CLASS -> MonitoredClasses index + 1, zero for classes we ignore
+UCHAR ClassIndex[MaxRegNtNotifyClass];
 
 // Globals
 
@@ -28,12 +94,20 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING)
 	bool symlinkCreated = false;
 
 	// g_Globals.Init();
-	// Initialize linked list head
-	InitializeListHead(&g_Globals.ItemsHead);
-	// Initialize Item counter
-	g_Globals.ItemCount = 0;
-	// Initialize Fastmutex
-	g_Globals.Mutex.Init();
+	// Build the notify class lookup
+	for (int i = 0; i < ARRAYSIZE(MonitoredClasses); i++)
+		ClassIndex[MonitoredClasses[i].Class] = (UCHAR)(i + 1);
+
+	g_Globals.RuleGeneration = 1;
+	// Verdicts cached before any rule exists must never match
+	g_Globals.VerdictEpoch = 1;
+	g_Globals.MemoryLimit = DefaultRuleMemoryLimit;
+
+	// Initialize the protected keys table
+	g_Globals.Keys.Init(PagedPool, DRIVER_TAG);
+	g_Globals.Subtrees.Init(PagedPool, DRIVER_TAG);
+	// Initialize the lock guarding the keys
+	g_Globals.Lock.Init();
 
 	do
 	{
@@ -64,6 +138,7 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING)
 
 	if (!NT_SUCCESS(status))
 	{
+		g_Globals.Lock.Delete();
 		if (symlinkCreated)
 			IoDeleteSymbolicLink(&symName);
 		if (DeviceObject)
@@ -93,12 +168,9 @@ void DriverUnload(_In_ PDRIVER_OBJECT DriverObject)
 	IoDeleteSymbolicLink(&symName);
 	IoDeleteDevice(DriverObject->DeviceObject);
 
-	while (!IsListEmpty(&g_Globals.ItemsHead))
-	{
-		auto entry = RemoveHeadList(&g_Globals.ItemsHead);
-		ExFreePool(CONTAINING_RECORD(entry, FullItem<RegKeyProtectInfo>, Entry));
-	}
-	g_Globals.ItemCount = 0;
+	g_Globals.Keys.Clear();
+	g_Globals.Subtrees.Clear();
+	g_Globals.Lock.Delete();
 
 	return;
 }
@@ -113,20 +185,59 @@ NTSTATUS DriverCreateClose(_In_ PDEVICE_OBJECT, _In_ PIRP Irp)
 }
 
 // Good
-void PushItem(LIST_ENTRY* entry)
+NTSTATUS PushItem(const kstring_view& keyName)
 {
-	AutoLock<FastMutex> lock(g_Globals.Mutex); // till now to the end of the function we will have Mutex
+	AutoLock<ExecutiveResource> lock(g_Globals.Lock); // till now to the end of the function we will own the lock
 											   // and will be freed on destructor at the end of the function
-	if (g_Globals.ItemCount > MaxRegKeyCount)
+	auto status = AddKey(keyName);
+	RulesChanged();
+	return status;
+}
+
+// callers hold the lock exclusively
+NTSTATUS AddKey(const kstring_view& keyName)
+{
+	auto& keys = g_Globals.Keys;
+	if (keys.Find(keyName) != KeyTable::NotFound)
 	{
-		// too many items, remove oldest one
-		auto head = RemoveHeadList(&g_Globals.ItemsHead);
-		g_Globals.ItemCount--;
-		ExFreePool(CONTAINING_RECORD(head, FullItem<RegKeyProtectInfo*>, Entry));
+		// already protected
+		return STATUS_SUCCESS;
 	}
 
-	InsertTailList(&g_Globals.ItemsHead, entry);
-	g_Globals.ItemCount++;
+	if (RuleBytes() + keys.InsertCost(keyName.Length()) > g_Globals.MemoryLimit)
+		return STATUS_QUOTA_EXCEEDED;
+
+	return keys.Insert(keyName);
+}
+
+// callers hold the lock exclusively
+NTSTATUS AddSubtree(PCUNICODE_STRING keyName)
+{
+	auto status = g_Globals.Subtrees.Insert(keyName);
+	if (status == STATUS_OBJECT_NAME_COLLISION)
+	{
+		status = STATUS_SUCCESS;	// already protected
+	}
+	else if (NT_SUCCESS(status) && RuleBytes() > g_Globals.MemoryLimit)
+	{
+		// the trie's cost is only known once the nodes exist
+		g_Globals.Subtrees.Remove(keyName);
+		status = STATUS_QUOTA_EXCEEDED;
+	}
+	return status;
+}
+
+// callers hold the lock
+SIZE_T RuleBytes()
+{
+	return g_Globals.Keys.Bytes() + g_Globals.Subtrees.Bytes();
+}
+
+// callers hold the lock exclusively
+void RulesChanged()
+{
+	InterlockedIncrement(&g_Globals.RuleGeneration);
+	InterlockedIncrement(&g_Globals.VerdictEpoch);
 }
 
 // TBD
@@ -150,23 +261,18 @@ NTSTATUS DriverDeviceControl(_In_ PDEVICE_OBJECT, _In_ PIRP Irp)
 			break;
 		}
 
-		KdPrint(("The Registry Path to Protect is: %ws", inputBuffer));
-
-		auto size = sizeof(FullItem<RegKeyProtectInfo>);
-		auto info = (FullItem<RegKeyProtectInfo>*)ExAllocatePoolWithTag(PagedPool, size, DRIVER_TAG);
-		if (info == nullptr)
+		// the name need not be terminated, but must fit in the buffer
+		auto keyLength = (ULONG)::wcsnlen(inputBuffer, inputBufferSize / sizeof(WCHAR));
+		if (keyLength == 0 || keyLength >= MaxRegNameSize)
 		{
-			KdPrint((DRIVER_PREFIX "Failed to Allocate Memory.\n"));
-			status = STATUS_INSUFFICIENT_RESOURCES;
+			status = STATUS_INVALID_PARAMETER;
 			break;
 		}
 
-		RtlZeroMemory(info, size);
+		auto keyName = kstring_view(inputBuffer, keyLength).ToUnicodeString();
+		KdPrint(("The Registry Path to Protect is: %wZ", &keyName));
 
-		auto& item = info->Data;
-		//auto RegKeyLength = inputBufferSize / sizeof(WCHAR);
-		RtlCopyMemory(item.KeyName, inputBuffer, inputBufferSize);
-		PushItem(&info->Entry);
+		status = PushItem(&keyName);
 		break;
 	}
 
@@ -185,43 +291,161 @@ NTSTATUS DriverDeviceControl(_In_ PDEVICE_OBJECT, _In_ PIRP Irp)
 
 		KdPrint(("The Registry Path to Protect is: %ws", inputBuffer));
 
-		AutoLock<FastMutex> lock(g_Globals.Mutex);
+		AutoLock<ExecutiveResource> lock(g_Globals.Lock);
 
-		UNICODE_STRING inputBF;
-		RtlInitUnicodeString(&inputBF, inputBuffer);
+		kstring_view inputName(inputBuffer, (ULONG)::wcsnlen(inputBuffer, inputBufferSize / sizeof(WCHAR)));
 
-		for (auto i = 0; i < g_Globals.ItemCount; i++)
+		auto index = g_Globals.Keys.Find(inputName);
+		if (index != KeyTable::NotFound)
+		{
+			KdPrint(("Found a Matching Protected key. Removing it from the table."));
+			g_Globals.Keys.Remove(index);
+			RulesChanged();
+		}
+		else
 		{
-			auto entry = RemoveHeadList(&g_Globals.ItemsHead);
-			auto info = CONTAINING_RECORD(entry, FullItem<RegKeyProtectInfo*>, Entry);
-			auto kName = (WCHAR*)&info->Data;
-
-			UNICODE_STRING tbcName;
-			RtlInitUnicodeString(&tbcName, kName);
-
-			if (RtlCompareUnicodeString(&inputBF, &tbcName, TRUE) == 0)
-			{
-				KdPrint(("Found a Matching Protected key. Removing it from the LinkedList."));
-				g_Globals.ItemCount--;
-				ExFreePool(CONTAINING_RECORD(entry, FullItem<RegKeyProtectInfo>, Entry));
-				break;
-			}
-			InsertTailList(&g_Globals.ItemsHead, entry);
+			status = STATUS_NOT_FOUND;
 		}
-		status = STATUS_INVALID_PARAMETER;
 		break;
 	}
 
 	case IOCTL_REGKEY_PROTECT_CLEAR:
 	{
 		KdPrint(("Sounding The Purge Siren! Removing all Protected RegKeys.\n"));
-		while (!IsListEmpty(&g_Globals.ItemsHead))
+		AutoLock<ExecutiveResource> lock(g_Globals.Lock);
+		g_Globals.Keys.Clear();
+		g_Globals.Subtrees.Clear();
+		RulesChanged();
+
+		break;
+	}
+
+	case IOCTL_REGKEY_PROTECT_GET_STATS:
+	{
+		auto stats = (RegProtectStats*)Irp->AssociatedIrp.SystemBuffer;
+		if (stats == nullptr || IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(RegProtectStats))
 		{
-			auto entry = RemoveHeadList(&g_Globals.ItemsHead);
-			ExFreePool(CONTAINING_RECORD(entry, FullItem<RegKeyProtectInfo>, Entry));
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
 		}
-		g_Globals.ItemCount = 0;
 
+		stats->Skipped = g_Globals.Skipped;
+		stats->CacheHits = g_Globals.CacheHits;
+		stats->CacheMisses = g_Globals.CacheMisses;
+		for (int i = 0; i < (int)RegOperation::Count; i++)
+		{
+			stats->Checked[i] = g_Globals.Checked[i];
+			stats->Blocked[i] = g_Globals.Blocked[i];
+		}
+		len = sizeof(RegProtectStats);
+		break;
+	}
+
+	case IOCTL_REGKEY_PROTECT_GET_USAGE:
+	{
+		auto usage = (RegProtectUsage*)Irp->AssociatedIrp.SystemBuffer;
+		if (usage == nullptr || IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(RegProtectUsage))
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		AutoSharedLock<ExecutiveResource> lock(g_Globals.Lock);
+		usage->Keys = g_Globals.Keys.Count();
+		usage->Subtrees = g_Globals.Subtrees.Count();
+		usage->Bytes = RuleBytes();
+		usage->Limit = g_Globals.MemoryLimit;
+		len = sizeof(RegProtectUsage);
+		break;
+	}
+
+	case IOCTL_REGKEY_PROTECT_SET_LIMIT:
+	{
+		auto limit = (ULONG*)Irp->AssociatedIrp.SystemBuffer;
+		if (limit == nullptr || IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG))
+		{
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+
+		// existing rules are kept, the new ceiling only applies to later adds
+		AutoLock<ExecutiveResource> lock(g_Globals.Lock);
+		g_Globals.MemoryLimit = *limit;
+		break;
+	}
+
+	case IOCTL_REGKEY_PROTECT_LIST:
+	{
+		ULONG written = 0;
+		status = ListRules(Irp->AssociatedIrp.SystemBuffer, IrpStack->Parameters.DeviceIoControl.InputBufferLength,
+			IrpStack->Parameters.DeviceIoControl.OutputBufferLength, &written);
+		len = written;
+		break;
+	}
+
+	case IOCTL_REGKEY_PROTECT_ADD_BULK:
+	{
+		auto buffer = Irp->AssociatedIrp.SystemBuffer;
+		if (buffer == nullptr)
+		{
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		if (IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(RegBulkResult))
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		ULONG applied = 0;
+		NTSTATUS addStatus;
+		status = AddRules(buffer, IrpStack->Parameters.DeviceIoControl.InputBufferLength, &applied, &addStatus);
+		if (!NT_SUCCESS(status))
+			break;
+		KdPrint((DRIVER_PREFIX "Added %u rules (0x%08X)\n", applied, addStatus));
+
+		// a partial add still succeeds, or the I/O manager wouldn't copy the count
+		// back; input and output share the system buffer, the input has been consumed
+		auto result = (RegBulkResult*)buffer;
+		result->Applied = applied;
+		result->Status = addStatus;
+		len = sizeof(RegBulkResult);
+		break;
+	}
+
+	case IOCTL_REGKEY_PROTECT_ADD_TREE:
+	case IOCTL_REGKEY_PROTECT_REMOVE_TREE:
+	{
+		auto inputBufferSize = IrpStack->Parameters.DeviceIoControl.InputBufferLength;
+		auto inputBuffer = (WCHAR*)Irp->AssociatedIrp.SystemBuffer;
+
+		if (inputBufferSize == 0 || inputBuffer == nullptr)
+		{
+			KdPrint((DRIVER_PREFIX "The Registry Key passed is not Correct.\n"));
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+
+		auto keyLength = (ULONG)::wcsnlen(inputBuffer, inputBufferSize / sizeof(WCHAR));
+		if (keyLength == 0 || keyLength >= MaxRegNameSize)
+		{
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+
+		auto keyName = kstring_view(inputBuffer, keyLength).ToUnicodeString();
+		KdPrint(("The Registry Subtree is: %wZ\n", &keyName));
+
+		AutoLock<ExecutiveResource> lock(g_Globals.Lock);
+		if (IrpStack->Parameters.DeviceIoControl.IoControlCode == IOCTL_REGKEY_PROTECT_ADD_TREE)
+		{
+			status = AddSubtree(&keyName);
+		}
+		else if (!g_Globals.Subtrees.Remove(&keyName))
+		{
+			status = STATUS_NOT_FOUND;
+		}
+		RulesChanged();
 		break;
 	}
 		
@@ -237,46 +461,298 @@ NTSTATUS DriverDeviceControl(_In_ PDEVICE_OBJECT, _In_ PIRP Irp)
 	return status;
 }
 
-// TBD
-NTSTATUS OnRegistryNotify(PVOID, PVOID arg1, PVOID arg2) {
+struct ListContext
+{
+	PUCHAR Next;		// where the next record goes
+	ULONG Remaining;	// bytes left in the output buffer
+	ULONG Count;
+};
 
-	auto status = STATUS_SUCCESS;
+// appends a record if it fits
+bool AppendRule(ListContext& list, PCWCH name, ULONG length, USHORT flags)
+{
+	auto size = FIELD_OFFSET(RegRuleEntry, Name) + length * sizeof(WCHAR);
+	if (size > list.Remaining)
+		return false;
+
+	auto record = (RegRuleEntry*)list.Next;
+	record->Flags = flags;
+	record->Length = (USHORT)(length * sizeof(WCHAR));
+	RtlCopyMemory(record->Name, name, length * sizeof(WCHAR));
+	list.Next += size;
+	list.Remaining -= size;
+	list.Count++;
+	return true;
+}
+
+bool AppendSubtree(PCWCH path, USHORT length, PVOID context)
+{
+	return AppendRule(*(ListContext*)context, path, length, RegRuleSubtree);
+}
+
+// the cursor counts rules: the exact keys in insertion order, then the subtrees
+NTSTATUS ListRules(PVOID buffer, ULONG inputLength, ULONG outputLength, ULONG* written)
+{
+	*written = 0;
+	if (buffer == nullptr || outputLength < sizeof(RegRuleListHeader))
+		return STATUS_BUFFER_TOO_SMALL;
+
+	// read before the output overwrites it
+	ULONG cursor = inputLength >= sizeof(ULONG) ? *(ULONG*)buffer : 0;
+
+	auto header = (RegRuleListHeader*)buffer;
+	ListContext list{ (PUCHAR)(header + 1), outputLength - (ULONG)sizeof(RegRuleListHeader), 0 };
 
-	switch ((REG_NOTIFY_CLASS)(ULONG_PTR)arg1) {
-	case RegNtPreSetValueKey: 
+	AutoSharedLock<ExecutiveResource> lock(g_Globals.Lock);
+	auto& keys = g_Globals.Keys;
+	auto next = cursor;
+	for (; next < keys.Count(); next++)
 	{
-		auto preInfo = static_cast<PREG_SET_VALUE_KEY_INFORMATION>(arg2);
-		PCUNICODE_STRING keyName = nullptr;
-		if (!NT_SUCCESS(CmCallbackGetKeyObjectID(&g_Globals.RegCookie, preInfo->Object, nullptr, &keyName))) {
+		auto name = keys.Name(next);
+		if (!AppendRule(list, name.Data(), name.Length(), 0))
 			break;
+	}
+
+	auto total = keys.Count() + g_Globals.Subtrees.Count();
+	if (next >= keys.Count() && next < total)
+	{
+		WCHAR path[MaxRegNameSize];
+		auto before = list.Count;
+		g_Globals.Subtrees.Enumerate(next - keys.Count(), path, MaxRegNameSize, AppendSubtree, &list);
+		next += list.Count - before;
+	}
+
+	if (list.Count == 0 && next < total)
+		return STATUS_BUFFER_TOO_SMALL;	// not even one record fits
+
+	header->Count = list.Count;
+	header->NextCursor = next >= total ? RegRuleListEnd : next;
+	header->Generation = (ULONG)g_Globals.RuleGeneration;
+	*written = (ULONG)(list.Next - (PUCHAR)buffer);
+	return STATUS_SUCCESS;
+}
+
+// fails only for a malformed list; otherwise addStatus is the first add's failure, if any
+NTSTATUS AddRules(PVOID buffer, ULONG size, ULONG* applied, NTSTATUS* addStatus)
+{
+	*applied = 0;
+
+	// validate the whole list before adding anything
+	if (size < sizeof(RegRuleListHeader))
+		return STATUS_INVALID_PARAMETER;
+
+	auto header = (RegRuleListHeader*)buffer;
+	auto data = (PUCHAR)(header + 1);
+	auto remaining = size - sizeof(RegRuleListHeader);
+	for (ULONG i = 0; i < header->Count; i++)
+	{
+		if (remaining < FIELD_OFFSET(RegRuleEntry, Name))
+			return STATUS_INVALID_PARAMETER;
+		auto record = (RegRuleEntry*)data;
+		auto length = record->Length;
+		if (length % sizeof(WCHAR) || length == 0 || length >= MaxRegNameSize * sizeof(WCHAR)
+			|| (record->Flags & ~RegRuleSubtree) || remaining - FIELD_OFFSET(RegRuleEntry, Name) < length)
+			return STATUS_INVALID_PARAMETER;
+		data += FIELD_OFFSET(RegRuleEntry, Name) + length;
+		remaining -= FIELD_OFFSET(RegRuleEntry, Name) + length;
+	}
+
+	AutoLock<ExecutiveResource> lock(g_Globals.Lock);
+	auto status = STATUS_SUCCESS;
+	data = (PUCHAR)(header + 1);
+	for (ULONG i = 0; i < header->Count && NT_SUCCESS(status); i++)
+	{
+		auto record = (RegRuleEntry*)data;
+		data += FIELD_OFFSET(RegRuleEntry, Name) + record->Length;
+
+		auto keyName = kstring_view(record->Name, record->Length / sizeof(WCHAR)).ToUnicodeString();
+		status = (record->Flags & RegRuleSubtree) ? AddSubtree(&keyName) : AddKey(&keyName);
+		if (NT_SUCCESS(status))
+			(*applied)++;
+	}
+	*addStatus = status;
+	RulesChanged();
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS OnRegistryNotify(PVOID, PVOID arg1, PVOID arg2)
+{
+	auto notifyClass = (REG_NOTIFY_CLASS)(ULONG_PTR)arg1;
+	auto index = notifyClass < MaxRegNtNotifyClass ? ClassIndex[notifyClass] : 0;
+	if (index == 0)
+	{
+		// reads, other post notifications and the like. RegNtCallbackObjectContextCleanup
+		// lands here too: the cached verdict is the context value itself, so
+		// there is nothing to free.
+		InterlockedIncrement(&g_Globals.Skipped);
+		return STATUS_SUCCESS;
+	}
+
+	auto& monitored = MonitoredClasses[index - 1];
+	if (monitored.Target == KeyTarget::Invalidate)
+	{
+		// A verdict computed between the pre-rename bump and the rename itself
+		// holds for the old name, yet carries the current epoch; only a bump
+		// after the rename is done retires it
+		if (NT_SUCCESS(static_cast<PREG_POST_OPERATION_INFORMATION>(arg2)->Status))
+			InterlockedIncrement(&g_Globals.VerdictEpoch);
+		return STATUS_SUCCESS;
+	}
+
+	auto operation = (int)monitored.Operation;
+	InterlockedIncrement(&g_Globals.Checked[operation]);
+
+	bool blocked;
+	if (monitored.Target == KeyTarget::CreateParent)
+	{
+		blocked = IsCreateBlocked(static_cast<PREG_CREATE_KEY_INFORMATION>(arg2));
+	}
+	else
+	{
+		// all the other pre-operation structures begin with the key object
+		auto object = *static_cast<PVOID*>(arg2);
+
+		// sampled before the lookup, so a rule change racing with it leaves a stale verdict
+		auto epoch = ReadNoFence(&g_Globals.VerdictEpoch);
+		auto context = *(PVOID*)((PUCHAR)arg2 + monitored.ContextOffset);
+		if (VerdictMatches(context, epoch))
+		{
+			InterlockedIncrement(&g_Globals.CacheHits);
+			blocked = ((ULONG_PTR)context & VerdictBlocked) != 0;
 		}
-		
-		// KdPrint(("Keyname to be Compared is: %wZ", keyName));
+		else
+		{
+			PCUNICODE_STRING keyName = nullptr;
+			if (!NT_SUCCESS(CmCallbackGetKeyObjectID(&g_Globals.RegCookie, object, nullptr, &keyName)))
+				return STATUS_SUCCESS;
+
+			// KdPrint(("Keyname to be Compared is: %wZ", keyName));
+			blocked = IsKeyProtected(keyName);
+			InterlockedIncrement(&g_Globals.CacheMisses);
+			CmSetCallbackObjectContext(object, &g_Globals.RegCookie, MakeVerdict(epoch, blocked), nullptr);
+		}
+
+		// renaming changes the names of the key and everything below it, so the
+		// cached verdicts go, here and again in RegNtPostRenameKey; the rules
+		// themselves didn't change, so no lock and RuleGeneration stays, or
+		// exports in progress would start over
+		if (!blocked && monitored.Operation == RegOperation::RenameKey)
+			InterlockedIncrement(&g_Globals.VerdictEpoch);
+	}
+
+	if (!blocked)
+		return STATUS_SUCCESS;
+
+	KdPrint(("Found a Matching Protected key. Blocking Any Modification Attempts."));
+	InterlockedIncrement(&g_Globals.Blocked[operation]);
+	// a bypassed create would report success without a key object to return
+	if (monitored.Target == KeyTarget::CreateParent)
+		return STATUS_ACCESS_DENIED;
+	return STATUS_CALLBACK_BYPASS;
+}
 
-		AutoLock<FastMutex> lock(g_Globals.Mutex);
+bool IsKeyProtected(PCUNICODE_STRING keyName)
+{
+	// lookups only read the table, so callbacks on other threads proceed in parallel
+	AutoSharedLock<ExecutiveResource> lock(g_Globals.Lock);
+	return g_Globals.Keys.Find(kstring_view(keyName)) != KeyTable::NotFound || g_Globals.Subtrees.MatchSubtree(keyName);
+}
+
+// A new key may not be created directly under a protected key, nor anywhere
+// below a protected subtree. Opening an existing key through create is
+// allowed, so the key's existence is checked first; a key deleted between
+// that check and the create would still be created.
+bool IsCreateBlocked(PREG_CREATE_KEY_INFORMATION info)
+{
+	// read without the lock: a create racing with the first rule is as if it came first
+	if (g_Globals.Keys.Count() == 0 && g_Globals.Subtrees.Count() == 0)
+		return false;
+
+	kstring_view name(info->CompleteName);
+	if (name.IsEmpty())
+		return false;
+
+	// a single relative component goes directly under the root object, whose
+	// verdict is cached like any other key's
+	auto relative = name[0] != L'\\';
+	auto underRoot = relative && name.FindLast(L'\\') == kstring_view::npos;
+	auto epoch = ReadNoFence(&g_Globals.VerdictEpoch);
+	if (underRoot && VerdictMatches(info->RootObjectContext, epoch))
+	{
+		InterlockedIncrement(&g_Globals.CacheHits);
+		if (((ULONG_PTR)info->RootObjectContext & VerdictBlocked) == 0)
+			return false;
+	}
 
-		for (auto i = 0; i < g_Globals.ItemCount; i++)
+	// build the full name: CompleteName is either absolute or relative to the root object
+	PCUNICODE_STRING rootName = nullptr;
+	ULONG rootLength = 0;
+	if (relative)
+	{
+		if (!NT_SUCCESS(CmCallbackGetKeyObjectID(&g_Globals.RegCookie, info->RootObject, nullptr, &rootName)))
+			return false;
+		rootLength = rootName->Length / sizeof(WCHAR) + 1;
+
+		if (underRoot && !VerdictMatches(info->RootObjectContext, epoch))
 		{
-			auto entry = RemoveHeadList(&g_Globals.ItemsHead);
-			auto info = CONTAINING_RECORD(entry, FullItem<RegKeyProtectInfo*>, Entry);
-			auto kName = (WCHAR*)&info->Data;
-
-			UNICODE_STRING tbcName;
-			RtlInitUnicodeString(&tbcName, kName);
-			// KdPrint(("KeyName(U_C) In Linked List is: %wZ!\n", tbcName));
-
-			if (RtlCompareUnicodeString(keyName, &tbcName, TRUE) == 0)
-			{
-				KdPrint(("Found a Matching Protected key. Blocking Any Modification Attempts."));
-				InsertTailList(&g_Globals.ItemsHead, entry);
-				status = STATUS_CALLBACK_BYPASS;
-				break;
-			}
-			InsertTailList(&g_Globals.ItemsHead, entry);
-			
+			// the parent is the root object itself
+			auto rootProtected = IsKeyProtected(rootName);
+			InterlockedIncrement(&g_Globals.CacheMisses);
+			CmSetCallbackObjectContext(info->RootObject, &g_Globals.RegCookie, MakeVerdict(epoch, rootProtected), nullptr);
+			if (!rootProtected)
+				return false;
 		}
 	}
+
+	auto length = rootLength + name.Length();
+	if (length * sizeof(WCHAR) > MAXUSHORT)
+		return false;
+
+	// most key names fit on the stack
+	WCHAR stackBuffer[CreateNameStackLength];
+	auto buffer = stackBuffer;
+	if (length > CreateNameStackLength)
+	{
+		buffer = (WCHAR*)ExAllocatePoolWithTag(PagedPool, length * sizeof(WCHAR), DRIVER_TAG);
+		if (buffer == nullptr)
+			return false;
 	}
 
-	return status;
-}
\ No newline at end of file
+	if (rootName)
+	{
+		RtlCopyMemory(buffer, rootName->Buffer, rootName->Length);
+		buffer[rootLength - 1] = L'\\';
+	}
+	RtlCopyMemory(buffer + rootLength, name.Data(), name.Length() * sizeof(WCHAR));
+
+	// the parent is everything before the last component
+	kstring_view keyName(buffer, length);
+	auto pos = keyName.FindLast(L'\\');
+	auto blocked = false;
+	if (pos != kstring_view::npos && pos > 0)
+	{
+		auto parent = keyName.Substr(0, pos).ToUnicodeString();
+		if (underRoot || IsKeyProtected(&parent))
+		{
+			auto key = keyName.ToUnicodeString();
+			blocked = !KeyExists(&key);
+		}
+	}
+	if (buffer != stackBuffer)
+		ExFreePoolWithTag(buffer, DRIVER_TAG);
+	return blocked;
+}
+
+// a kernel handle skips the access check; the open goes through the registry
+// callback again, but opens aren't monitored
+bool KeyExists(PUNICODE_STRING keyName)
+{
+	OBJECT_ATTRIBUTES keyAttr;
+	InitializeObjectAttributes(&keyAttr, keyName, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr, nullptr);
+	HANDLE hKey;
+	if (!NT_SUCCESS(ZwOpenKey(&hKey, KEY_QUERY_VALUE, &keyAttr)))
+		return false;
+
+	ZwClose(hKey);
+	return true;
+}
@@ -1,20 +1,32 @@
 #pragma once
 
-#include "FastMutex.h"
+#include "ExecutiveResource.h"
+#include "KeyTable.h"
+#include "PathTrie.h"
+#include "RegistryProtectorCommon.h"
 
 #define DRIVER_TAG 'NICE'
 #define DRIVER_PREFIX "RegistryProtector: "
 
 typedef struct _Globals
 {
-	LIST_ENTRY ItemsHead;
-	int ItemCount;
-	FastMutex Mutex;
+	KeyTable Keys;		// exact keys
+	PathTrie Subtrees;	// keys protected with all their subkeys
+	ExecutiveResource Lock;	// shared for lookups, exclusive for changes
 	LARGE_INTEGER RegCookie;
+	SIZE_T MemoryLimit;	// for Keys and Subtrees together, guarded by Lock
+	LONG volatile RuleGeneration;	// bumped on every rule change, reported by LIST
+	LONG volatile VerdictEpoch;		// bumped on rule changes and renames; older cached verdicts are stale
+	LONG volatile Skipped;
+	LONG volatile Checked[(int)RegOperation::Count];
+	LONG volatile Blocked[(int)RegOperation::Count];
+	LONG volatile CacheHits;
+	LONG volatile CacheMisses;
 
 } Globals, *PGlobals;
 
-const int MaxRegKeyCount = 10;
+// adjustable with IOCTL_REGKEY_PROTECT_SET_LIMIT
+const SIZE_T DefaultRuleMemoryLimit = 4 * 1024 * 1024;
 
 template <typename T>
 struct FullItem
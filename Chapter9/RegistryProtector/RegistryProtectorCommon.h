@@ -5,9 +5,81 @@
 #define IOCTL_REGKEY_PROTECT_ADD	CTL_CODE(0x8000, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_REGKEY_PROTECT_REMOVE	CTL_CODE(0x8000, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_REGKEY_PROTECT_CLEAR	CTL_CODE(0x8000, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
+// protect a key together with all of its subkeys
+#define IOCTL_REGKEY_PROTECT_ADD_TREE		CTL_CODE(0x8000, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_REGKEY_PROTECT_REMOVE_TREE	CTL_CODE(0x8000, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_REGKEY_PROTECT_GET_STATS		CTL_CODE(0x8000, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_REGKEY_PROTECT_GET_USAGE		CTL_CODE(0x8000, 0x806, METHOD_BUFFERED, FILE_ANY_ACCESS)
+// input: ULONG, the memory budget for all rules in bytes
+#define IOCTL_REGKEY_PROTECT_SET_LIMIT		CTL_CODE(0x8000, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+// input: ULONG cursor (zero to start), output: a rule list
+#define IOCTL_REGKEY_PROTECT_LIST			CTL_CODE(0x8000, 0x808, METHOD_BUFFERED, FILE_ANY_ACCESS)
+// input: a rule list, output: RegBulkResult
+#define IOCTL_REGKEY_PROTECT_ADD_BULK		CTL_CODE(0x8000, 0x809, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 
+// longest key path accepted, in characters including the NULL terminator
 const int MaxRegNameSize = 300;
-struct RegKeyProtectInfo {
-	WCHAR KeyName[MaxRegNameSize]{};
+
+// the registry operations the driver checks, in RegProtectStats order
+enum class RegOperation {
+	DeleteKey,
+	SetValue,
+	DeleteValue,
+	SetInformation,
+	RenameKey,
+	CreateKey,
+	ReplaceKey,
+	RestoreKey,
+	SetSecurity,
+	Count
+};
+
+// A rule list is a header followed by Count packed records, each flags,
+// a byte length and that many bytes of name (no NULL).
+// LIST returns as many rules as fit starting at the cursor it was given,
+// and the cursor to pass next, or RegRuleListEnd once all were returned.
+// A different Generation between calls means the rules changed meanwhile.
+// ADD_BULK applies the records in order and stops at the first failure;
+// the cursor and generation are ignored. It fails only if the list itself
+// is malformed (nothing is applied then); otherwise it succeeds and its
+// RegBulkResult output tells how far it got.
+const ULONG RegRuleListEnd = (ULONG)-1;
+
+struct RegRuleListHeader {
+	ULONG Count;
+	ULONG NextCursor;
+	ULONG Generation;
+};
+
+// IOCTL_REGKEY_PROTECT_ADD_BULK output
+struct RegBulkResult {
+	ULONG Applied;		// records added before the first failure
+	LONG Status;		// NTSTATUS of that failure, zero if all were added
+};
+
+const USHORT RegRuleSubtree = 1;	// protect the key and all of its subkeys
+
+struct RegRuleEntry {
+	USHORT Flags;
+	USHORT Length;
+	WCHAR Name[1];
+};
+
+// IOCTL_REGKEY_PROTECT_GET_USAGE output. Adds fail with
+// STATUS_QUOTA_EXCEEDED (ERROR_NOT_ENOUGH_QUOTA) rather than go past Limit.
+struct RegProtectUsage {
+	ULONG Keys;			// exact key rules
+	ULONG Subtrees;		// subtree rules
+	ULONGLONG Bytes;	// pool memory the rules take
+	ULONGLONG Limit;	// the memory budget
+};
+
+// IOCTL_REGKEY_PROTECT_GET_STATS output
+struct RegProtectStats {
+	ULONG Skipped;		// callbacks for operations that don't modify keys
+	ULONG Checked[(int)RegOperation::Count];
+	ULONG Blocked[(int)RegOperation::Count];
+	ULONG CacheHits;	// verdicts taken from the key object's context
+	ULONG CacheMisses;	// verdicts that needed the key name
 };